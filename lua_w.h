@@ -39,6 +39,24 @@ SOFTWARE.
 #include <new> // Used in TypeWrapper (for inplace new)
 #include <utility> // Used in TypeWrapper (for checking if operator overloads exist)
 #include <string> // Used in stack_push and stack_get for C++ string support
+#include <string_view> // Used in the bundle searcher (for the module index)
+#include <vector> // Used in make_bundle and TypeBuilder
+#include <unordered_map> // Used in the bundle searcher (for the module index) and TypeWrapper (for deferred bindings)
+#include <cstdio> // Used in add_bundle_searcher (for reading bundle files)
+#include <cstring> // Used in the bundle searcher
+#include <functional> // Used in TypeWrapper (for deferred bindings)
+#include <mutex> // Used in TypeWrapper (for deferred bindings shared by all states)
+#include <unordered_set> // Used in ObservedTable (for changed keys) and make_bundle (for duplicate names)
+#include <chrono> // Used in TableCursor (for deadlines)
+#include <algorithm> // Used in numeric array functions of tables
+#include <array> // Used in stack_push and stack_get for container support
+#include <map> // Used in stack_push and stack_get for container support
+#include <set> // Used in stack_push and stack_get for container support
+#include <optional> // Used in stack_push and stack_get for optional values
+#include <variant> // Used in stack_push and stack_get for variants
+#include <list> // Used in Memoized (for the LRU order)
+#include <clocale> // Used in JsonEncoder (for the decimal point of the locale)
+#include <cmath> // Used in numeric array functions of tables (for comparing integers with floats)
 
 // Lua helper functions
 namespace lua_w
@@ -55,6 +73,49 @@ namespace lua_w
         constexpr bool has_lua_type_name_v = false;
         template<class T>
         constexpr bool has_lua_type_name_v<T, std::void_t<decltype(T::lua_type_name())>> = std::is_same_v<decltype(T::lua_type_name()), const char*>;
+
+        // Helpers for detecting standard containers (they are converted to and from tables)
+        template<class>
+        constexpr bool is_vector_v = false;
+        template<class T, class TAlloc>
+        constexpr bool is_vector_v<std::vector<T, TAlloc>> = true;
+
+        template<class>
+        constexpr bool is_std_array_v = false;
+        template<class T, size_t N>
+        constexpr bool is_std_array_v<std::array<T, N>> = true;
+
+        template<class>
+        constexpr bool is_map_v = false;
+        template<class TKey, class TValue, class TCompare, class TAlloc>
+        constexpr bool is_map_v<std::map<TKey, TValue, TCompare, TAlloc>> = true;
+        template<class TKey, class TValue, class THash, class TEqual, class TAlloc>
+        constexpr bool is_map_v<std::unordered_map<TKey, TValue, THash, TEqual, TAlloc>> = true;
+
+        template<class>
+        constexpr bool is_set_v = false;
+        template<class TKey, class TCompare, class TAlloc>
+        constexpr bool is_set_v<std::set<TKey, TCompare, TAlloc>> = true;
+
+        template<class>
+        constexpr bool is_optional_v = false;
+        template<class T>
+        constexpr bool is_optional_v<std::optional<T>> = true;
+
+        template<class>
+        constexpr bool is_variant_v = false;
+        template<class... Ts>
+        constexpr bool is_variant_v<std::variant<Ts...>> = true;
+    }
+
+    template<typename TSignature>
+    class TypedFunction;
+
+    namespace internal {
+        template<class>
+        constexpr bool is_typed_function_v = false;
+        template<class TRet, class... TArgs>
+        constexpr bool is_typed_function_v<TypedFunction<TRet(TArgs...)>> = true;
     
         class Error : public std::runtime_error {
             const char* typeName;
@@ -78,6 +139,15 @@ namespace lua_w
         };
     }
 
+    // Types of Lua values (the values are the same as Lua's type constants)
+    enum class Type : int {
+        none = LUA_TNONE, nil = LUA_TNIL, boolean = LUA_TBOOLEAN, light_userdata = LUA_TLIGHTUSERDATA, number = LUA_TNUMBER,
+        string = LUA_TSTRING, table = LUA_TTABLE, function = LUA_TFUNCTION, userdata = LUA_TUSERDATA, thread = LUA_TTHREAD
+    };
+
+    // Returns the type of the value at 'idx'
+    Type type_of(lua_State* L, int idx) noexcept;
+
     // Adds lua_w data to the created state
     // You should always call this, but it is only required when using
     // lua_w::Table or lua_w::Function
@@ -88,11 +158,25 @@ namespace lua_w
     // If you want for example: base and math pass (Libs::base | Libs::math)
     void open_libs(lua_State* L, uint16_t libs) noexcept;
 
+    // Opens the passed in libs lazily. Only base and package are opened right away, for every other library
+    // a stub is installed and the library is opened on the first access to its global (eg. the first use of 'math')
+    // When package is opened the stubs are also added to 'package.preload', so 'require' works for them too
+    // This makes creating short-lived states cheaper, as scripts usually only touch a few libraries
+    void open_libs_lazy(lua_State* L, uint16_t libs) noexcept;
+
+    // Streaming sink used by the serialisation functions. It's called with consecutive pieces of the output
+    using Writer = std::function<void(const char* data, size_t size)>;
+
+    // Streaming source used by the deserialisation functions. It has to fill the whole buffer (or throw an exception if there is no more data)
+    using Reader = std::function<void(char* data, size_t size)>;
+
     #ifndef LUA_W_NO_PTR_SAFETY
     // Base class for all of the registered Lua types
     class LuaBaseObject { public: virtual ~LuaBaseObject() {} };
     #endif
 
+    class ObservedTable;
+
     // Internal data for functions and tables
     namespace internal {
         template<typename TValue>
@@ -101,6 +185,9 @@ namespace lua_w
         template<typename TValue>
         TValue stack_get(lua_State* L, int idx);
 
+        template<typename TValue>
+        std::optional<TValue> stack_try_get(lua_State* L, int idx) noexcept;
+
         // Object that holds a holds a reference to a Lua object so it is accessible in C++ and will not be garbage collected by Lua
         struct LuaObjectReference {
             lua_State* L;
@@ -145,6 +232,80 @@ namespace lua_w
         constexpr bool for_each_matches_v<T, TKey, TValue, std::void_t<decltype(std::declval<T>()(std::declval<TKey>(), std::declval<TValue>()))>> = true;
     }
 
+    //----------------------------
+    // KEYS
+    //----------------------------
+
+    // A string key that is created once and kept alive, so using it doesn't hash or intern the string again
+    // It can be used in place of a string key for Table::get, Table::set, Table::call_method and Object::call_method
+    class Key {
+        std::shared_ptr<internal::LuaObjectReference> keyPtr;
+
+        template<typename TValue>
+        friend class GlobalRef;
+    public:
+        Key(lua_State* L, const char* name) : keyPtr(std::make_shared<internal::LuaObjectReference>(L)) {
+            lua_pushstring(L, name);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, keyPtr->get_object_id());
+        }
+
+        // Pushes the key on to the stack
+        // No need to use this function on it's own
+        void push_to_stack(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, keyPtr->get_object_id());
+        }
+    };
+
+    namespace internal {
+        // Pushes the field of the value on top of the stack (metamethods are respected)
+        template<typename TKey>
+        void get_field(lua_State* L, const TKey& key) {
+            using key_t = std::decay_t<TKey>;
+            if constexpr (std::is_same_v<key_t, const char*> || std::is_same_v<key_t, char*>)
+                lua_getfield(L, -1, key);
+            else if constexpr (std::is_same_v<key_t, std::string>)
+                lua_getfield(L, -1, key.c_str());
+            else if constexpr (std::is_same_v<key_t, Key>) {
+                key.push_to_stack(L);
+                lua_gettable(L, -2);
+            }
+            else if constexpr (std::is_convertible_v<key_t, lua_Integer>)
+                lua_geti(L, -1, (lua_Integer)key);
+            else {
+                internal::stack_push(L, key);
+                lua_gettable(L, -2);
+            }
+        }
+
+        // Calls a method of the object on top of the stack (the object is popped). The object is passed as the first argument
+        // Errors are thrown as exceptions
+        template<typename TRet, typename TKey, typename... TArgs>
+        TRet call_method_impl(lua_State* L, const TKey& key, TArgs... args) {
+            get_field(L, key);
+            if (!lua_isfunction(L, -1)) {
+                lua_pop(L, 2);
+                throw Error("function", "Method doesn't exist");
+            }
+            lua_insert(L, -2); // The method goes below the object, so the object is it's first argument
+            (internal::stack_push(L, args), ...);
+            if (lua_pcall(L, sizeof...(TArgs) + 1, std::is_void_v<TRet> ? 0 : 1, 0) != LUA_OK) {
+                Error error("function", lua_isstring(L, -1) ? lua_tostring(L, -1) : "Error object is not a string");
+                lua_pop(L, 1);
+                throw error;
+            }
+            if constexpr (!std::is_void_v<TRet>) {
+                try {
+                    auto retVal = internal::stack_get<TRet>(L, -1);
+                    lua_pop(L, 1);
+                    return retVal;
+                } catch (...) {
+                    lua_pop(L, 1);
+                    throw;
+                }
+            }
+        }
+    }
+
     //----------------------------
     // TABLES
     //----------------------------
@@ -194,20 +355,9 @@ namespace lua_w
         // TKey, and TValue can be anything that can be pushed and pulled from the stack
         template<typename TValue, typename TKey>
         TValue get(const TKey& key) const {
-            using key_t = std::decay_t<TKey>;
             lua_State* L = tablePtr->L;
             lua_rawgetp(L, LUA_REGISTRYINDEX, tablePtr->get_object_id());
-
-            if constexpr (std::is_same_v<key_t, const char*> || std::is_same_v<key_t, char*>)
-                lua_getfield(L, -1, key);
-            else if constexpr (std::is_same_v<key_t, std::string>)
-                lua_getfield(L, -1, key.c_str());
-            else if constexpr (std::is_convertible_v<key_t, lua_Integer>)
-                lua_geti(L, -1, (lua_Integer)key);
-            else {
-                internal::stack_push(L, key);
-                lua_gettable(L, -2);
-            }
+            internal::get_field(L, key);
 
             auto retVal = internal::stack_get<TValue>(L, -1);
 
@@ -215,6 +365,19 @@ namespace lua_w
             return retVal;
         }
 
+        // Returns a value that was keyed by the passed in key or an empty optional if it doesn't exist or has a wrong type (no exceptions are thrown)
+        template<typename TValue, typename TKey>
+        std::optional<TValue> try_get(const TKey& key) const noexcept {
+            lua_State* L = tablePtr->L;
+            lua_rawgetp(L, LUA_REGISTRYINDEX, tablePtr->get_object_id());
+            internal::get_field(L, key);
+
+            auto retVal = internal::stack_try_get<TValue>(L, -1);
+
+            lua_pop(L, 2);
+            return retVal;
+        }
+
         // Sets the passed value in the table under the passed in key
         // TKey, and TValue can be anything that can be pushed and pulled from the stack
         template<typename TKey, typename TValue>
@@ -231,6 +394,11 @@ namespace lua_w
                 internal::stack_push(L, value);
                 lua_setfield(L, -2, key.c_str());
             }
+            else if constexpr (std::is_same_v<key_t, Key>) {
+                key.push_to_stack(L);
+                internal::stack_push(L, value);
+                lua_settable(L, -3);
+            }
             else if constexpr (std::is_convertible_v<key_t, lua_Integer>) {
                 internal::stack_push(L, value);
                 lua_seti(L, -2, (lua_Integer)key);
@@ -243,6 +411,15 @@ namespace lua_w
             lua_pop(L, 1);
         }
     
+        // Calls a function stored in the table with the table as the first argument (like 'table:method(args)' in Lua)
+        // The key can be a string, an integer or a lua_w::Key. Throws an exception if there is no such function or if it raises an error
+        template<typename TRet, typename TKey, typename... TArgs>
+        TRet call_method(const TKey& key, TArgs... args) const {
+            lua_State* L = tablePtr->L;
+            lua_rawgetp(L, LUA_REGISTRYINDEX, tablePtr->get_object_id());
+            return internal::call_method_impl<TRet>(L, key, std::move(args) ...);
+        }
+
         template<typename TKey, typename TValue, typename Function>
         void for_each(const Function& function) const {
             static_assert(internal::for_each_matches_v<Function, TKey, TValue>, "The 'for_each' callable can't be called with the 'TKey', and 'TValue' types");
@@ -259,6 +436,25 @@ namespace lua_w
                 luaL_error(L, "While iterating over a table, key or value couldn't be retrieved or were of a wrong type (%s)", e.what());
             }
         }
+
+        // Functions below work on the array part (keys 1..n) that has to contain only numbers (otherwise an exception is thrown)
+        // The values are loaded once in to a contiguous buffer. Arrays of integers stay integers when written back
+
+        // Sorts the array in place (NaNs are placed at the end)
+        void sort_numeric(bool descending = false) const;
+
+        // Returns the sum of the array
+        lua_Number sum() const;
+
+        // Returns the smallest and the largest value of the array. Throws an exception if the array is empty
+        std::pair<lua_Number, lua_Number> min_max() const;
+
+        // Returns the index of the value in an array sorted in ascending order or 0 if the value isn't in the array
+        // Only the probed elements are read (the array isn't loaded)
+        lua_Integer binary_search(lua_Number value) const;
+
+        // Removes consecutive duplicates (so all duplicates in a sorted array) and returns the new length of the array
+        lua_Unsigned unique() const;
     };
 
     //----------------------------
@@ -308,18 +504,381 @@ namespace lua_w
         }
     };
 
+    // Class that represents a lua function with a fixed signature
+    // The conversion code is instantiated once per signature (in the call thunk), not at every call site
+    // Unlike Function it calls in protected mode, so errors form Lua are thrown as exceptions
+    template<typename TRet, typename... TArgs>
+    class TypedFunction<TRet(TArgs...)> {
+        std::shared_ptr<internal::LuaObjectReference> funcPtr;
+        TypedFunction(const std::shared_ptr<internal::LuaObjectReference>& ref) : funcPtr(ref) {}
+
+        // The call thunk, shared by all calls with this signature
+        static TRet call_thunk(const internal::LuaObjectReference& ref, TArgs... args) {
+            lua_State* L = ref.L;
+            lua_rawgetp(L, LUA_REGISTRYINDEX, ref.get_object_id());
+            (internal::stack_push(L, args), ...);
+            if (lua_pcall(L, sizeof...(TArgs), std::is_void_v<TRet> ? 0 : 1, 0) != LUA_OK) {
+                internal::Error error("function", lua_isstring(L, -1) ? lua_tostring(L, -1) : "Error object is not a string");
+                lua_pop(L, 1);
+                throw error;
+            }
+            if constexpr (!std::is_void_v<TRet>) {
+                try {
+                    auto retVal = internal::stack_get<TRet>(L, -1);
+                    lua_pop(L, 1);
+                    return retVal;
+                } catch (...) {
+                    lua_pop(L, 1);
+                    throw;
+                }
+            }
+        }
+    public:
+        // Only used to retrieve functions form the stack
+        // No need to use this function on it's own
+        static TypedFunction get_form_stack(lua_State* L, int idx) noexcept {
+            TypedFunction func(std::make_shared<internal::LuaObjectReference>(L));
+
+            lua_pushvalue(L, idx);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, func.funcPtr->get_object_id());
+
+            return func;
+        }
+
+        // Calls the function. Throws an exception if the function raises an error or returns a value of a wrong type
+        TRet operator()(TArgs... args) const {
+            return call_thunk(*funcPtr, std::move(args) ...);
+        }
+
+        // Pushes the function that this object holds on to the stack
+        // No need to use this function on it's own
+        void push_to_stack(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, funcPtr->get_object_id());
+        }
+
+        // The std::function keeps the Lua function alive
+        operator std::function<TRet(TArgs...)>() const {
+            return [ref = funcPtr](TArgs... args) -> TRet { return call_thunk(*ref, std::move(args) ...); };
+        }
+    };
+
+    //----------------------------
+    // OBJECTS
+    //----------------------------
+
+    // Class that represents a Lua object: a table or any value with a metatable (eg. a bound userdata)
+    // Fields and methods are looked up like in Lua (through '__index')
+    class Object {
+        std::shared_ptr<internal::LuaObjectReference> objectPtr;
+        Object(const std::shared_ptr<internal::LuaObjectReference>& ref) : objectPtr(ref) {}
+    public:
+        // Only used to retrieve objects form the stack
+        // No need to use this function on it's own
+        static Object get_form_stack(lua_State* L, int idx) noexcept {
+            Object object(std::make_shared<internal::LuaObjectReference>(L));
+
+            lua_pushvalue(L, idx);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, object.objectPtr->get_object_id());
+
+            return object;
+        }
+
+        // Pushes the object on to the stack
+        // No need to use this function on it's own
+        void push_to_stack(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, objectPtr->get_object_id());
+        }
+
+        // Returns a field of the object. The key can be a string, an integer or a lua_w::Key
+        template<typename TValue, typename TKey>
+        TValue get(const TKey& key) const {
+            lua_State* L = objectPtr->L;
+            push_to_stack(L);
+            internal::get_field(L, key);
+            try {
+                auto value = internal::stack_get<TValue>(L, -1);
+                lua_pop(L, 2);
+                return value;
+            } catch (...) {
+                lua_pop(L, 2);
+                throw;
+            }
+        }
+
+        // Calls a method of the object (like 'object:method(args)' in Lua). The key can be a string or a lua_w::Key
+        // Throws an exception if there is no such method or if it raises an error
+        template<typename TRet, typename TKey, typename... TArgs>
+        TRet call_method(const TKey& key, TArgs... args) const {
+            lua_State* L = objectPtr->L;
+            push_to_stack(L);
+            return internal::call_method_impl<TRet>(L, key, std::move(args) ...);
+        }
+    };
+
+    //----------------------------
+    // MEMOIZATION
+    //----------------------------
+
+    namespace internal {
+        // Combines hashes of all of the arguments
+        template<typename... TArgs>
+        struct TupleHash {
+            size_t operator()(const std::tuple<TArgs...>& args) const noexcept {
+                size_t seed = 0;
+                std::apply([&seed](const auto&... arg) {
+                    ((seed ^= std::hash<std::decay_t<decltype(arg)>>()(arg) + 0x9e3779b9 + (seed << 6) + (seed >> 2)), ...);
+                }, args);
+                return seed;
+            }
+        };
+
+        // Type in which an argument is stored in the cache. C strings are copied, so they are compared by their contents (not addresses)
+        template<typename T>
+        using memo_key_t = std::conditional_t<std::is_same_v<std::decay_t<T>, const char*> || std::is_same_v<std::decay_t<T>, char*>, std::string, std::decay_t<T>>;
+    }
+
+    // Caches results of a pure Lua function, so repeated calls with the same arguments don't call in to Lua
+    // Arguments are hashed after conversion to C++, so all argument types need a std::hash specialisation
+    // C string arguments are copied in to the cache, other pointers are not allowed as arguments or return values
+    // At most 'capacity' results are kept, the least recently used one is dropped first
+    template<typename TSignature>
+    class Memoized;
+
+    template<typename TRet, typename... TArgs>
+    class Memoized<TRet(TArgs...)> {
+        static_assert(!std::is_void_v<TRet>, "Only functions that return a value can be memoized");
+        static_assert(!std::is_pointer_v<TRet>, "Cached pointers could outlive the values they point to, return values instead (eg. std::string instead of const char*)");
+        static_assert((!std::is_pointer_v<internal::memo_key_t<TArgs>> && ...), "Pointer arguments would be cached by their address, pass values instead");
+        using key_t = std::tuple<internal::memo_key_t<TArgs>...>;
+        using entry_t = std::pair<key_t, TRet>;
+
+        TypedFunction<TRet(TArgs...)> function;
+        size_t capacity;
+        std::list<entry_t> entries; // Most recently used first
+        std::unordered_map<key_t, typename std::list<entry_t>::iterator, internal::TupleHash<internal::memo_key_t<TArgs>...>> index;
+        size_t hitCount = 0;
+        size_t missCount = 0;
+    public:
+        Memoized(const TypedFunction<TRet(TArgs...)>& function, size_t capacity) : function(function), capacity(capacity) {
+            index.reserve(capacity);
+        }
+
+        // Returns the cached result or calls the function (exceptions from the call are passed on and nothing is cached)
+        TRet operator()(TArgs... args) {
+            key_t key(args...);
+            auto found = index.find(key);
+            if (found != index.end()) {
+                hitCount++;
+                entries.splice(entries.begin(), entries, found->second);
+                return found->second->second;
+            }
+            missCount++;
+            TRet result = function(std::move(args) ...);
+            if (capacity == 0)
+                return result;
+            if (entries.size() >= capacity) {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+            entries.emplace_front(std::move(key), result);
+            index.emplace(entries.front().first, entries.begin());
+            return result;
+        }
+
+        // Drops all cached results (eg. after the scripts were reloaded)
+        void invalidate() noexcept {
+            index.clear();
+            entries.clear();
+        }
+
+        // Replaces the function (eg. with the reloaded version) and drops all cached results
+        void invalidate(const TypedFunction<TRet(TArgs...)>& newFunction) {
+            function = newFunction;
+            invalidate();
+        }
+
+        size_t hits() const noexcept { return hitCount; }
+        size_t misses() const noexcept { return missCount; }
+        size_t size() const noexcept { return entries.size(); }
+    };
+
+    //----------------------------
+    // EVENTS
+    //----------------------------
+
+    // Dispatches events to many Lua listeners. All listeners are kept in one Lua table in the order of dispatch
+    // Arguments are converted once per dispatch and copied for every listener. Every listener is called in protected mode,
+    // so an error in one of them doesn't stop the others
+    // Listeners can be added and removed during a dispatch: removed ones aren't called anymore and added ones are called form the next dispatch
+    class EventBus {
+        struct Listener {
+            size_t id;
+            int priority;
+            bool removed;
+        };
+
+        std::shared_ptr<internal::LuaObjectReference> busPtr; // Table: { listeners in the order of dispatch, id -> listener }
+        std::vector<Listener> listeners; // Same order as the Lua array
+        std::vector<Listener> pending; // Added during a dispatch
+        std::function<void(const char*)> errorHandler;
+        size_t nextId = 1;
+        int dispatching = 0;
+        bool dirty = false;
+
+        // Removes the removed listeners, adds the pending ones and rewrites the Lua array
+        void rebuild() noexcept;
+    public:
+        EventBus(lua_State* L);
+        EventBus(const EventBus&) = delete;
+        EventBus& operator=(const EventBus&) = delete;
+
+        // Adds a listener and returns it's id. Listeners with a higher priority are called first (same priorities in the order of adding)
+        size_t add_listener(const Function& listener, int priority = 0) noexcept;
+
+        // Removes a listener. Returns false if there was no such listener
+        bool remove_listener(size_t id) noexcept;
+
+        // Sets a function that gets the error messages of the listeners that failed
+        void set_error_handler(const std::function<void(const char*)>& handler) {
+            errorHandler = handler;
+        }
+
+        // Returns the number of the listeners (including the ones added during the current dispatch)
+        size_t listener_count() const noexcept;
+
+        // Calls all listeners with the arguments. Returns the number of the listeners that failed
+        template<typename... TArgs>
+        size_t dispatch(TArgs... args) {
+            lua_State* L = busPtr->L;
+            int top = lua_gettop(L);
+            lua_rawgetp(L, LUA_REGISTRYINDEX, busPtr->get_object_id());
+            lua_rawgeti(L, -1, 1);
+            int listenersIdx = lua_gettop(L);
+            (internal::stack_push(L, args), ...); // Converted only once
+            size_t failed = 0;
+            size_t count = listeners.size(); // Listeners added during the dispatch are in 'pending', so the array doesn't change
+            dispatching++;
+            try {
+                for (size_t i = 0; i < count; i++) {
+                    if (listeners[i].removed)
+                        continue;
+                    lua_rawgeti(L, listenersIdx, (lua_Integer)i + 1);
+                    for (int arg = 1; arg <= (int)sizeof...(TArgs); arg++)
+                        lua_pushvalue(L, listenersIdx + arg);
+                    if (lua_pcall(L, sizeof...(TArgs), 0, 0) != LUA_OK) {
+                        failed++;
+                        if (errorHandler)
+                            errorHandler(lua_isstring(L, -1) ? lua_tostring(L, -1) : "Error object is not a string");
+                        lua_pop(L, 1);
+                    }
+                }
+            } catch (...) {
+                dispatching--;
+                lua_settop(L, top);
+                throw;
+            }
+            dispatching--;
+            lua_settop(L, top);
+            if (dispatching == 0 && dirty)
+                rebuild();
+            return failed;
+        }
+    };
+
     //----------------------------
     // STACK MANIPULATIONS
     //----------------------------
 
     namespace internal {
+        template<typename TValue>
+        bool stack_is(lua_State* L, int idx) noexcept;
+
+        template<class TVariant, size_t... Is>
+        bool variant_is(lua_State* L, int idx, std::index_sequence<Is...>) noexcept {
+            return (stack_is<std::variant_alternative_t<Is, TVariant>>(L, idx) || ...);
+        }
+
+        // Checks (without throwing) if the value at 'idx' can be retrieved as TValue. Only the type of the value is checked,
+        // so elements of containers can still fail to convert
+        template<typename TValue>
+        bool stack_is(lua_State* L, int idx) noexcept {
+            using value_t = std::decay_t<TValue>;
+            if constexpr (std::is_same_v<value_t, Table> || is_vector_v<value_t> || is_std_array_v<value_t> || is_map_v<value_t> || is_set_v<value_t>)
+                return lua_istable(L, idx);
+            else if constexpr (std::is_same_v<value_t, Function> || is_typed_function_v<value_t>)
+                return lua_isfunction(L, idx);
+            else if constexpr (std::is_same_v<value_t, Object>) {
+                if (lua_istable(L, idx))
+                    return true;
+                if (!lua_getmetatable(L, idx))
+                    return false;
+                lua_pop(L, 1);
+                return true;
+            }
+            else if constexpr (std::is_same_v<value_t, bool>)
+                return lua_isboolean(L, idx);
+            else if constexpr (std::is_convertible_v<value_t, lua_Number>)
+                return lua_isnumber(L, idx);
+            else if constexpr (std::is_same_v<value_t, const char*> || std::is_same_v<value_t, std::string>)
+                return lua_isstring(L, idx);
+            else if constexpr (std::is_pointer_v<value_t>) {
+                #ifndef LUA_W_NO_PTR_SAFETY
+                if constexpr (std::is_convertible_v<value_t, LuaBaseObject*>)
+                    return lua_isuserdata(L, idx) && dynamic_cast<value_t>((LuaBaseObject*)lua_touserdata(L, idx)) != nullptr;
+                else
+                #endif
+                    return lua_isuserdata(L, idx);
+            }
+            else if constexpr (is_optional_v<value_t>)
+                return lua_isnoneornil(L, idx) || stack_is<typename value_t::value_type>(L, idx);
+            else if constexpr (is_variant_v<value_t>)
+                return variant_is<value_t>(L, idx, std::make_index_sequence<std::variant_size_v<value_t>>{});
+            else
+                return false;
+        }
+
+        // Like stack_is, but only accepts values that don't need a conversion (eg. a numeric string isn't a number)
+        // Numbers match integral types only when they are integers and floating point types only when they are floats
+        template<typename TValue>
+        bool stack_is_exact(lua_State* L, int idx) noexcept {
+            using value_t = std::decay_t<TValue>;
+            int type = lua_type(L, idx);
+            if constexpr (std::is_same_v<value_t, bool>)
+                return type == LUA_TBOOLEAN;
+            else if constexpr (std::is_convertible_v<value_t, lua_Number>)
+                return type == LUA_TNUMBER && std::is_integral_v<value_t> == (lua_isinteger(L, idx) != 0);
+            else if constexpr (std::is_same_v<value_t, const char*> || std::is_same_v<value_t, std::string>)
+                return type == LUA_TSTRING;
+            else if constexpr (is_optional_v<value_t>)
+                return type == LUA_TNIL || type == LUA_TNONE || stack_is_exact<typename value_t::value_type>(L, idx);
+            else
+                return stack_is<value_t>(L, idx);
+        }
+
+        // Picks the first alternative that matches exactly and then the first one that can be converted
+        template<class TVariant, size_t... Is>
+        TVariant variant_get(lua_State* L, int idx, std::index_sequence<Is...>) {
+            std::optional<TVariant> result;
+            auto try_alternative = [L, idx, &result](auto index, bool exact) {
+                using alternative_t = std::variant_alternative_t<decltype(index)::value, TVariant>;
+                if (exact ? stack_is_exact<alternative_t>(L, idx) : stack_is<alternative_t>(L, idx)) {
+                    result.emplace(std::in_place_index<decltype(index)::value>, stack_get<alternative_t>(L, idx));
+                    return true;
+                }
+                return false;
+            };
+            if ((try_alternative(std::integral_constant<size_t, Is>{}, true) || ...) || (try_alternative(std::integral_constant<size_t, Is>{}, false) || ...))
+                return std::move(*result);
+            throw lua_w::internal::Error("variant", "Value doesn't match any of the variant's types");
+        }
+
         // NOTE: You only need to use this function if you want to directly manipulate the stack
         // Pushes the TValue on to the stack (can push numbers, bools, c-style strings, lua_w::Tables, lua_w::Functions, all pointers and copies of objects registerd in the lua VM)
         template<typename TValue>
         void stack_push(lua_State* L, const TValue& value) noexcept {
             static_assert(!std::is_reference_v<TValue>, "Using references is not supported, use pointers instead");
             using value_t = std::decay_t<TValue>; // Remove references, const and volatile kewyords to better match the types
-            if constexpr (std::is_same_v<value_t, Table> || std::is_same_v<value_t, Function>) // Table and Function have the same interface
+            if constexpr (std::is_same_v<value_t, Table> || std::is_same_v<value_t, Function> || std::is_same_v<value_t, ObservedTable> || is_typed_function_v<value_t> || std::is_same_v<value_t, Object> || std::is_same_v<value_t, Key>) // They all have the same interface
                 value.push_to_stack(L);
             else if constexpr (std::is_same_v<value_t, bool>)
                 lua_pushboolean(L, value);
@@ -328,7 +887,7 @@ namespace lua_w
             else if constexpr (std::is_same_v<value_t, const char*> || std::is_same_v <value_t, char*>) // Lua makes a copy of the string
                 lua_pushstring(L, value);
             else if constexpr (std::is_same_v<value_t, std::string>)
-                lua_pushstring(L, value.c_str());
+                lua_pushlstring(L, value.data(), value.size()); // Strings can contain zeros (eg. bytecode)
             else if constexpr (std::is_pointer_v<value_t>)
                 lua_pushlightuserdata(L, (void*)value);
             else if constexpr (internal::has_lua_type_name_v<value_t>) {
@@ -338,6 +897,43 @@ namespace lua_w
                 new(ptr) TValue(value);
                 luaL_setmetatable(L, std::remove_pointer_t<value_t>::lua_type_name());
             }
+            else if constexpr (is_vector_v<value_t> || is_std_array_v<value_t>) {
+                // Sequences are pushed as arrays
+                lua_checkstack(L, 3);
+                lua_createtable(L, (int)value.size(), 0);
+                lua_Integer i = 1;
+                for (const auto& element : value) {
+                    internal::stack_push(L, element);
+                    lua_rawseti(L, -2, i++);
+                }
+            }
+            else if constexpr (is_map_v<value_t>) {
+                lua_checkstack(L, 3);
+                lua_createtable(L, 0, (int)value.size());
+                for (const auto& [key, element] : value) {
+                    internal::stack_push(L, key);
+                    internal::stack_push(L, element);
+                    lua_rawset(L, -3);
+                }
+            }
+            else if constexpr (is_optional_v<value_t>) {
+                if (value.has_value())
+                    internal::stack_push(L, *value);
+                else
+                    lua_pushnil(L);
+            }
+            else if constexpr (is_variant_v<value_t>)
+                std::visit([L](const auto& alternative) { internal::stack_push(L, alternative); }, value);
+            else if constexpr (is_set_v<value_t>) {
+                // Sets are pushed as tables with their elements as keys (key = true)
+                lua_checkstack(L, 3);
+                lua_createtable(L, 0, (int)value.size());
+                for (const auto& key : value) {
+                    internal::stack_push(L, key);
+                    lua_pushboolean(L, 1);
+                    lua_rawset(L, -3);
+                }
+            }
             else
                 internal::no_match(); // No matching type was found
         }
@@ -349,8 +945,10 @@ namespace lua_w
         TValue stack_get(lua_State* L, int idx) {
             static_assert(!std::is_reference_v<TValue>, "Using references is not supported, use pointers instead");
             using value_t = std::decay_t<TValue>; // Remove references, const and volatile kewyords to better match the types
-            if constexpr (std::is_same_v<value_t, Function>)
-                return lua_isfunction(L, idx) ? Function::get_form_stack(L, idx) : throw lua_w::internal::Error("function", "Required value is not a function");
+            if constexpr (std::is_same_v<value_t, Function> || is_typed_function_v<value_t>)
+                return lua_isfunction(L, idx) ? value_t::get_form_stack(L, idx) : throw lua_w::internal::Error("function", "Required value is not a function");
+            else if constexpr (std::is_same_v<value_t, Object>)
+                return stack_is<Object>(L, idx) ? Object::get_form_stack(L, idx) : throw lua_w::internal::Error("object", "Required value is not a table and has no metatable");
             else if constexpr (std::is_same_v<value_t, Table>)
                 return lua_istable(L, idx) ? Table::get_form_stack(L, idx) : throw lua_w::internal::Error("table", "Required value is not a table");
             else if constexpr (std::is_same_v <value_t, bool>)
@@ -359,8 +957,11 @@ namespace lua_w
                 return lua_isnumber(L, idx) ? static_cast<TValue>(lua_tonumber(L, idx)) : throw lua_w::internal::Error("number", "Required value is not numeric");
             else if constexpr (std::is_same_v<value_t, const char*>)
                 return lua_isstring(L, idx) ? lua_tostring(L, idx) : throw lua_w::internal::Error("string", "Required value is not a string");
-            else if constexpr (std::is_same_v<value_t, std::string>)
-                return lua_isstring(L, idx) ? std::string(lua_tostring(L, idx)) : throw lua_w::internal::Error("string", "Required value is not a string");
+            else if constexpr (std::is_same_v<value_t, std::string>) {
+                size_t length;
+                const char* str = lua_tolstring(L, idx, &length);
+                return str ? std::string(str, length) : throw lua_w::internal::Error("string", "Required value is not a string");
+            }
             else if constexpr (std::is_pointer_v<value_t>) {
                 #ifndef LUA_W_NO_PTR_SAFETY
                 if constexpr (std::is_convertible_v<value_t, LuaBaseObject*>) {
@@ -374,9 +975,78 @@ namespace lua_w
                 #endif
                     return (TValue)lua_touserdata(L, idx);
             }
+            else if constexpr (is_optional_v<value_t>) {
+                // Nil and missing arguments are empty optionals
+                if (lua_isnoneornil(L, idx))
+                    return std::nullopt;
+                return internal::stack_get<typename value_t::value_type>(L, idx);
+            }
+            else if constexpr (is_variant_v<value_t>)
+                return variant_get<value_t>(L, idx, std::make_index_sequence<std::variant_size_v<value_t>>{});
+            else if constexpr (is_vector_v<value_t> || is_std_array_v<value_t> || is_map_v<value_t> || is_set_v<value_t>) {
+                if (!lua_istable(L, idx))
+                    throw lua_w::internal::Error("table", "Required value is not a table");
+                if (!lua_checkstack(L, 3))
+                    throw lua_w::internal::Error("table", "Containers are nested too deeply");
+                idx = lua_absindex(L, idx);
+                value_t container{};
+                if constexpr (is_vector_v<value_t> || is_std_array_v<value_t>) {
+                    lua_Unsigned length = lua_rawlen(L, idx);
+                    if constexpr (is_vector_v<value_t>)
+                        container.reserve(length);
+                    else if (length != container.size())
+                        throw lua_w::internal::Error("table", "Array has a wrong number of elements");
+                    for (lua_Unsigned i = 0; i < length; i++) {
+                        lua_rawgeti(L, idx, (lua_Integer)i + 1);
+                        try {
+                            if constexpr (is_vector_v<value_t>)
+                                container.push_back(internal::stack_get<typename value_t::value_type>(L, -1));
+                            else
+                                container[i] = internal::stack_get<typename value_t::value_type>(L, -1);
+                        } catch (...) {
+                            lua_pop(L, 1);
+                            throw;
+                        }
+                        lua_pop(L, 1);
+                    }
+                } else {
+                    lua_pushnil(L);
+                    while (lua_next(L, idx) != 0) {
+                        lua_pushvalue(L, -2); // Keys are converted from a copy, so converting them (eg. numbers to strings) doesn't break lua_next
+                        try {
+                            auto key = internal::stack_get<typename value_t::key_type>(L, -1);
+                            if constexpr (is_map_v<value_t>)
+                                container.emplace(std::move(key), internal::stack_get<typename value_t::mapped_type>(L, -2));
+                            else if (lua_toboolean(L, -2)) // Only keys with true values are elements of a set
+                                container.insert(std::move(key));
+                        } catch (...) {
+                            lua_pop(L, 3);
+                            throw;
+                        }
+                        lua_pop(L, 2);
+                    }
+                }
+                return container;
+            }
             else
                 internal::no_match();
         }
+
+        // NOTE: You only need to use this function if you want to directly manipulate the stack
+        // Returns a value from the provided stack position or an empty optional if it can't be converted to the required type
+        // The type is checked first, so exceptions are only used if elements of a container fail to convert
+        template<typename TValue>
+        std::optional<TValue> stack_try_get(lua_State* L, int idx) noexcept {
+            if (!stack_is<TValue>(L, idx))
+                return std::nullopt;
+            int top = lua_gettop(L);
+            try {
+                return stack_get<TValue>(L, idx);
+            } catch (const lua_w::internal::Error&) {
+                lua_settop(L, top);
+                return std::nullopt;
+            }
+        }
     }
 
     //----------------------------
@@ -444,13 +1114,101 @@ namespace lua_w
         lua_setglobal(L, funcName); // Assign the pushed closure a name to make it a global function
     }
 
-    //----------------------------
-    // GLOBAL VALUES
-    //----------------------------
+    namespace internal {
+        // Retrieves the next argument (the counter is the index of the last retrieved argument, so it points at the failing one)
+        template<typename TArg>
+        TArg next_arg(lua_State* L, int& argCounter) {
+            return internal::stack_get<TArg>(L, ++argCounter);
+        }
 
-    // Attempts to get a global value form the lua VM.
-    // If the global doen't exist or is of a wrong type this function throws an exception
-    // If you don't want to handle exceptions check beforhand if everything matches using 'has_global'
+        // Retrieves the arguments form the stack, calls the callable and pushes the result
+        template<typename TRet, typename... TArgs, typename TCallable>
+        int call_with_stack_args(lua_State* L, const TCallable& callable) noexcept {
+            int argCounter = 0;
+            try {
+                std::tuple<TArgs...> args = { next_arg<TArgs>(L, argCounter) ... };
+                if constexpr (std::is_void_v<TRet>) {
+                    std::apply(callable, std::move(args));
+                    return 0;
+                } else {
+                    internal::stack_push<TRet>(L, std::apply(callable, std::move(args)));
+                    return 1;
+                }
+            } catch (const lua_w::internal::Error& e) {
+                luaL_typeerror(L, argCounter, e.type());
+                return 0;
+            }
+        }
+
+        template<class>
+        struct member_function_traits;
+        template<class TClass, typename TRet, typename... TArgs>
+        struct member_function_traits<TRet(TClass::*)(TArgs...)> {
+            using object_t = TClass;
+            template<typename TMethod>
+            static int call(lua_State* L, object_t* object, TMethod method) noexcept {
+                return call_with_stack_args<TRet, TArgs...>(L, [object, method](TArgs... args) { return (object->*method)(std::move(args) ...); });
+            }
+        };
+        template<class TClass, typename TRet, typename... TArgs>
+        struct member_function_traits<TRet(TClass::*)(TArgs...) const> {
+            using object_t = const TClass;
+            template<typename TMethod>
+            static int call(lua_State* L, object_t* object, TMethod method) noexcept {
+                return call_with_stack_args<TRet, TArgs...>(L, [object, method](TArgs... args) { return (object->*method)(std::move(args) ...); });
+            }
+        };
+        // noexcept is a part of the type since C++17
+        template<class TClass, typename TRet, typename... TArgs>
+        struct member_function_traits<TRet(TClass::*)(TArgs...) noexcept> : member_function_traits<TRet(TClass::*)(TArgs...)> {};
+        template<class TClass, typename TRet, typename... TArgs>
+        struct member_function_traits<TRet(TClass::*)(TArgs...) const noexcept> : member_function_traits<TRet(TClass::*)(TArgs...) const> {};
+
+        // Closure for a method pointer known at compile time. Upvalues: object pointer
+        template<auto Method>
+        int bound_method(lua_State* L) noexcept {
+            using traits_t = member_function_traits<decltype(Method)>;
+            auto object = (typename traits_t::object_t*)lua_touserdata(L, lua_upvalueindex(1));
+            return traits_t::call(L, object, Method);
+        }
+
+        // Closure for a method pointer passed at runtime. Upvalues: object pointer, userdata with the method pointer
+        template<typename TMethod>
+        int bound_method_ptr(lua_State* L) noexcept {
+            using traits_t = member_function_traits<TMethod>;
+            auto object = (typename traits_t::object_t*)lua_touserdata(L, lua_upvalueindex(1));
+            TMethod method;
+            std::memcpy(&method, lua_touserdata(L, lua_upvalueindex(2)), sizeof(TMethod));
+            return traits_t::call(L, object, method);
+        }
+    }
+
+    // Pushes a function that calls the method on the object (Lua calls it without the self argument, eg. as a callback)
+    // The object isn't owned by Lua, so it has to outlive the function
+    // Member function pointers don't fit in to a light userdata, so the pointer is stored in a small userdata
+    template<class TClass, typename TMethod>
+    void bind(lua_State* L, TClass* object, TMethod method) noexcept {
+        static_assert(std::is_member_function_pointer_v<TMethod>, "Only member functions can be bound");
+        lua_pushlightuserdata(L, (void*)object);
+        std::memcpy(lua_newuserdatauv(L, sizeof(TMethod), 0), &method, sizeof(TMethod));
+        lua_pushcclosure(L, &internal::bound_method_ptr<TMethod>, 2);
+    }
+
+    // Pushes a function that calls the method on the object, with the method baked in to the function
+    // This version only needs the object pointer as an upvalue, so nothing is allocated besides the closure
+    template<auto Method>
+    void bind(lua_State* L, typename internal::member_function_traits<decltype(Method)>::object_t* object) noexcept {
+        lua_pushlightuserdata(L, (void*)object);
+        lua_pushcclosure(L, &internal::bound_method<Method>, 1);
+    }
+
+    //----------------------------
+    // GLOBAL VALUES
+    //----------------------------
+
+    // Attempts to get a global value form the lua VM.
+    // If the global doen't exist or is of a wrong type this function throws an exception
+    // If you don't want to handle exceptions check beforhand if everything matches using 'has_global'
     template<typename TValue>
     TValue get_global(lua_State* L, const char* globalName) {
         lua_getglobal(L, globalName); // Attempt to get a global by name, the value will be pushed to the lua stack
@@ -466,21 +1224,118 @@ namespace lua_w
         lua_setglobal(L, globalName); // Bind a global name to this value
     }
 
+    namespace internal {
+        using BoundGetter_t = void(*)(lua_State*, const void*);
+        using BoundSetter_t = void(*)(lua_State*, int, void*);
+
+        template<typename TValue>
+        void bound_get(lua_State* L, const void* variable) {
+            internal::stack_push(L, *(const TValue*)variable);
+        }
+
+        template<typename TValue>
+        void bound_set(lua_State* L, int idx, void* variable) {
+            *(TValue*)variable = internal::stack_get<TValue>(L, idx);
+        }
+
+        // Longest strings that Lua interns (LUAI_MAXSHORTLEN, which isn't a part of the public headers)
+        static constexpr size_t maxBoundNameLength = 40;
+
+        void bind_global_impl(lua_State* L, const char* globalName, void* variable, BoundGetter_t getter, BoundSetter_t setter);
+    }
+
+    // Binds a C++ variable as a global. Reads in Lua return the current value of the variable and writes change it (no need to set it again)
+    // Pointers to const variables are read-only in Lua. The variable has to outlive the state (or be bound again)
+    // This is done through '__index' and '__newindex' of the globals table (previous ones are still called for other globals)
+    // Names are looked up by the address of the interned string, so names longer than 40 characters (long strings aren't interned) can't be bound
+    // For those an exception is thrown (and nothing is changed)
+    // Don't set bound globals raw (eg. with 'rawset' or 'GlobalRef::set'), a raw global hides the binding until it's set to nil
+    template<typename TValue>
+    void bind_global(lua_State* L, const char* globalName, TValue* variable) {
+        using value_t = std::remove_const_t<TValue>;
+        internal::BoundSetter_t setter = nullptr;
+        if constexpr (!std::is_const_v<TValue>)
+            setter = &internal::bound_set<value_t>;
+        internal::bind_global_impl(L, globalName, (void*)variable, &internal::bound_get<value_t>, setter);
+    }
+
     // Allows to safely check if a global exists and has the required type
+    // Only the type is checked, so no handles are created for tables and functions
     template<typename TValue>
     bool has_global(lua_State* L, const char* globalName) noexcept {
-        try  { 
-            get_global<TValue>(L, globalName); 
-            return true; 
-        } catch (const lua_w::internal::Error& e) {
-            return false;
-        }
+        lua_getglobal(L, globalName);
+        bool matches = internal::stack_is<TValue>(L, -1);
+        lua_pop(L, 1);
+        return matches;
+    }
+
+    // Returns the global or an empty optional if it doesn't exist or has a wrong type (no exceptions are thrown)
+    template<typename TValue>
+    std::optional<TValue> try_get_global(lua_State* L, const char* globalName) noexcept {
+        lua_getglobal(L, globalName);
+        auto value = internal::stack_try_get<TValue>(L, -1);
+        lua_pop(L, 1);
+        return value;
     }
 
+    // A handle to a global that is accessed often. The name is interned once, so no strings are hashed on access
+    // Globals are read and written raw, so metamethods of the globals table (eg. 'bind_global' or lazy libraries) are NOT called
+    // Setting a global bound with 'bind_global' creates a regular global that hides the binding (until the global is set to nil)
+    template<typename TValue>
+    class GlobalRef {
+        Key key;
+
+        // Pushes the raw value of the global on to the stack
+        void push_value(lua_State* L) const noexcept {
+            lua_pushglobaltable(L);
+            key.push_to_stack(L);
+            lua_rawget(L, -2);
+            lua_remove(L, -2);
+        }
+    public:
+        GlobalRef(lua_State* L, const char* globalName) : key(L, globalName) {}
+
+        // Gets the value of the global. Throws if it doesn't exist or is of a wrong type
+        TValue get() const {
+            lua_State* L = key.keyPtr->L;
+            push_value(L);
+            try {
+                auto value = internal::stack_get<TValue>(L, -1);
+                lua_pop(L, 1);
+                return value;
+            } catch (...) {
+                lua_pop(L, 1);
+                throw;
+            }
+        }
+
+        // Gets the value of the global or an empty optional if it doesn't exist or has a wrong type
+        std::optional<TValue> try_get() const noexcept {
+            lua_State* L = key.keyPtr->L;
+            push_value(L);
+            auto value = internal::stack_try_get<TValue>(L, -1);
+            lua_pop(L, 1);
+            return value;
+        }
+
+        // Creates or sets the global
+        void set(const TValue& value) const noexcept {
+            lua_State* L = key.keyPtr->L;
+            lua_pushglobaltable(L);
+            key.push_to_stack(L);
+            internal::stack_push(L, value);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+    };
+
     //----------------------------
     // CLASS BINDING
     //----------------------------
 
+    template<class TClass>
+    class TypeBuilder;
+
     // Internal stuff for class binding
     namespace internal {
         // A pointer to a member function type (every class function that is not static is a member)
@@ -555,6 +1410,38 @@ namespace lua_w
         template<class T>
         constexpr bool has_unary_minus_v<T, std::void_t<decltype(-std::declval<T>())>> = std::is_same_v<decltype(-std::declval<T>()), T>;
 
+        // Helper for checking if the type has serialisation hooks:
+        // 'void lua_serialise(const lua_w::Writer&) const' and 'static TClass lua_deserialise(const lua_w::Reader&)'
+        template<class, class = void>
+        constexpr bool has_serialise_hooks_v = false;
+        template<class T>
+        constexpr bool has_serialise_hooks_v<T, std::void_t<decltype(std::declval<const T&>().lua_serialise(std::declval<const Writer&>())), decltype(T::lua_deserialise(std::declval<const Reader&>()))>> = 
+            std::is_same_v<decltype(T::lua_deserialise(std::declval<const Reader&>())), T>;
+
+        // Signatures of the serialisation hooks as they are stored in the metatable
+        using SerialiseFunc_t = void(*)(lua_State*, int, const Writer&);
+        using DeserialiseFunc_t = void(*)(lua_State*, const Reader&);
+
+        // Writes the object at 'idx' using it's serialisation hook
+        template<class TClass>
+        void serialise_object(lua_State* L, int idx, const Writer& writer) {
+            ((const TClass*)lua_touserdata(L, idx))->lua_serialise(writer);
+        }
+
+        // Reads an object using it's deserialisation hook and pushes it on to the stack
+        template<class TClass>
+        void deserialise_object(lua_State* L, const Reader& reader) {
+            internal::stack_push<TClass>(L, TClass::lua_deserialise(reader));
+        }
+
+        // Signature of the copy hook stored in the metatable. It pushes a copy of the object to the passed state
+        using CopyFunc_t = void(*)(lua_State*, const void*);
+
+        template<class TClass>
+        void copy_object(lua_State* L, const void* object) {
+            internal::stack_push<TClass>(L, *(const TClass*)object);
+        }
+
         // Implementation of a method call from Lua
         template<typename StoreType, class TClass, typename TRet, typename... TArgs>
         int call_method_impl(lua_State* L) {
@@ -588,19 +1475,354 @@ namespace lua_w
             lua_pushcclosure(L, &call_method_impl<StoreType, TClass, TRet, TArgs...>, 1);
         }
 
+        // Creates an accessor for a member variable and LEAVES it on top of the stack
+        // Called with no arguments it returns the value, called with one argument it assigns it
+        template<class TClass, typename TProp>
+        void wrap_member(lua_State* L, MemberPtr_t<TClass, TProp> memberPtr) {
+            using PtrStore_t = internal::MemberPtrStore<TClass, TProp>;
+            // Member pointers are stored the same way as method pointers
+            auto store = (PtrStore_t*)lua_newuserdatauv(L, sizeof(PtrStore_t), 0);
+            store->ptr = memberPtr;
+            lua_pushcclosure(L, [](lua_State* L) -> int {
+                TClass* self = (TClass*)lua_touserdata(L, 1);
+                auto memberPtr = ((PtrStore_t*)lua_touserdata(L, lua_upvalueindex(1)))->ptr;
+                // When there are no additional arguments on the stack we want to access the variable
+                if (lua_gettop(L) < 2) {
+                    internal::stack_push(L, self->*memberPtr);
+                    return 1;
+                } else {
+                    // We want to assign to it
+                    try {
+                        self->*memberPtr = internal::stack_get<TProp>(L, 2);
+                    } catch (const lua_w::internal::Error& e) {
+                        luaL_typeerror(L, 2, e.type());
+                    }
+                    return 0;
+                }
+            }, 1);
+        }
+
+        // Function that pushes one binding (method, member accessor, static method) on to the stack
+        using BindingPush_t = std::function<void(lua_State*)>;
+
+        // Descriptor of one deferred binding. 'identity' is the kind of the binding and the bytes of the bound pointer,
+        // so registering the same binding again can be told apart from registering a different one under the same name
+        struct DeferredBinding {
+            std::string identity;
+            BindingPush_t push;
+        };
+
+        // Descriptors of the deferred bindings of a type (name -> descriptor)
+        // They are recorded once per C++ type and shared by all states. Descriptors are never replaced or removed,
+        // so a found descriptor can be used after the mutex is unlocked
+        struct DeferredBindings {
+            std::mutex mutex;
+            std::unordered_map<std::string, DeferredBinding> bindings;
+        };
+
+        template<class TClass>
+        DeferredBindings& deferred_bindings() noexcept {
+            static DeferredBindings bindings;
+            return bindings;
+        }
+
+        // '__index' of a deferred type table. Called only when a key is missing in the type table (1 - type table, 2 - key)
+        template<class TClass>
+        int deferred_index(lua_State* L) {
+            if (lua_type(L, 2) == LUA_TSTRING) {
+                DeferredBindings& deferred = deferred_bindings<TClass>();
+                const DeferredBinding* binding = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(deferred.mutex);
+                    auto it = deferred.bindings.find(lua_tostring(L, 2));
+                    if (it != deferred.bindings.end())
+                        binding = &it->second;
+                }
+                if (binding) {
+                    // Create the binding and store it in the type table, so next lookups will not end up here
+                    binding->push(L);
+                    lua_pushvalue(L, 2);
+                    lua_pushvalue(L, -2);
+                    lua_rawset(L, 1);
+                    return 1;
+                }
+            }
+            // Not a binding of this type, look in the parent type (if there is one)
+            lua_getmetatable(L, 1);
+            if (lua_getfield(L, -1, "__parent") != LUA_TTABLE)
+                return 0;
+            lua_pushvalue(L, 2);
+            lua_gettable(L, -2);
+            return 1;
+        }
+
+        // Creates a presized type table and a presized metatable for the type and LEAVES both on the stack (metatable on top)
+        // 'typeFields' and 'metaFields' are the counts of the bindings that will be added to the tables
+        // The type table is also set as a global unless 'setGlobal' is false (eg. when it's a part of a module)
+        template<class TClass>
+        void create_type_tables(lua_State* L, int typeFields, int metaFields, bool setGlobal = true) noexcept {
+            constexpr const char* name = TClass::lua_type_name();
+
+            lua_createtable(L, 0, typeFields); // Create a new table for the type
+            if (setGlobal) {
+                lua_pushvalue(L, -1);
+                lua_setglobal(L, name); // Set the type table as a global (for access to static method)
+            }
+
+            // Register a metatable for the type (this is what luaL_newmetatable does, but we can presize the table)
+            lua_createtable(L, 0, metaFields + 7);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, LUA_REGISTRYINDEX, name);
+
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -2, "__index"); // Set the type table as the __index function (objects will look for method in this table)
+
+            // Add a destructor in the __gc metamethod if the object requires it
+            if constexpr (!std::is_trivially_destructible_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    TClass* ptr = (TClass*)lua_touserdata(L, 1);
+                    ptr->~TClass();
+                    return 0;
+                });
+                lua_setfield(L, -2, "__gc"); // Set the __gc metatable field to the destructor call
+            }
+
+            lua_pushstring(L, name);
+            lua_setfield(L, -2, "__name");
+
+            lua_pushliteral(L, "Can't access the metatable of a registered type");
+            lua_setfield(L, -2, "__metatable");
+
+            // Objects can be copied between states by calling their copy constructor
+            if constexpr (std::is_copy_constructible_v<TClass>) {
+                lua_pushlightuserdata(L, (void*)&copy_object<TClass>);
+                lua_setfield(L, -2, "__lua_w_copy");
+            }
+
+            // Serialisation hooks are stored as light userdata, so serialisation code can find them only knowing the metatable
+            if constexpr (has_serialise_hooks_v<TClass>) {
+                lua_pushlightuserdata(L, (void*)&serialise_object<TClass>);
+                lua_setfield(L, -2, "__lua_w_serialise");
+                lua_pushlightuserdata(L, (void*)&deserialise_object<TClass>);
+                lua_setfield(L, -2, "__lua_w_deserialise");
+            }
+        }
+
+        // Construction function (called as the '__call' metamethod of the type table)
+        template<class TClass, typename... TArgs>
+        int construct(lua_State* L) {
+            int argCounter = 2; // Omit the first argument (it's the type table)
+            try {
+                TClass* ptr = (TClass*)lua_newuserdatauv(L, sizeof(TClass), 0); // Allocate memory for the object
+                new(ptr) TClass{ internal::stack_get<TArgs>(L, argCounter++) ... }; // Call a inplace new constructor (Creates the object on the specified addres)
+                luaL_setmetatable(L, TClass::lua_type_name()); // Get the metatable and assign it to the created object
+                return 1;
+            } catch (const lua_w::internal::Error& e) {
+                luaL_typeerror(L, argCounter - 1, e.type());
+                return 0;
+            }
+        }
+
+        // Construction function that calls the default constructor when no arguments were passed
+        template<class TClass, typename... TArgs>
+        int construct_with_default(lua_State* L) {
+            int argCounter = 2; // Omit the first argument (it's the type table)
+            try {
+                TClass* ptr = (TClass*)lua_newuserdatauv(L, sizeof(TClass), 0); // Allocate memory for the object
+                if (lua_gettop(L) == 2) // Check if no arguments were passed first is the type table second is the created userdata
+                    new(ptr) TClass(); // Call a default constructor (if no arguments were passed)
+                else
+                    new(ptr) TClass{ internal::stack_get<TArgs>(L, argCounter++) ... }; // Call a inplace new constructor (Creates the object on the specified addres)
+                luaL_setmetatable(L, TClass::lua_type_name()); // Get the metatable and assign it to the created object
+                return 1;
+            } catch (const lua_w::internal::Error& e) {
+                luaL_typeerror(L, argCounter - 1, e.type());
+                return 0;
+            }
+        }
+
+        // Adds detected operators to the metatable that is on top of the stack
+        // For a operator to be detected it has to take this type as the right and left side of the operator
+        template<class TClass>
+        void set_detected_operators(lua_State* L) noexcept {
+            // Register the add operator
+            if constexpr (has_add_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    internal::stack_push<TClass>(L, *lhs + *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__add");
+            }
+
+            // Register the subtract operator
+            if constexpr (has_sub_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    internal::stack_push<TClass>(L, *lhs - *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__sub");
+            }
+
+            // Register the multiply operator
+            if constexpr (has_mult_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    internal::stack_push<TClass>(L, *lhs * *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__mul");
+            }
+
+            // Register the multiply operator
+            if constexpr (has_div_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    internal::stack_push<TClass>(L, *lhs / *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__div");
+            }
+
+            // Register the unary minus
+            if constexpr (has_unary_minus_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1))
+                        return 0;
+                    TClass* obj = (TClass*)lua_touserdata(L, 1);
+                    internal::stack_push<TClass>(L, -*obj);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__unm");
+            }
+
+            // Register the equlality operator
+            if constexpr (has_eq_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    lua_pushboolean(L, *lhs == *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__eq");
+            }
+
+            // Register the less-than operator
+            if constexpr (has_lt_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    lua_pushboolean(L, *lhs < *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__lt");
+            }
+
+            // Register the less-than or equal operator
+            if constexpr (has_lt_v<TClass>) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
+                        return 0;
+                    TClass* lhs = (TClass*)lua_touserdata(L, 1);
+                    TClass* rhs = (TClass*)lua_touserdata(L, 2);
+                    lua_pushboolean(L, *lhs <= *rhs);
+                    return 1;
+                });
+                lua_setfield(L, -2, "__le");
+            }
+        }
+
         // Class for wrapping a type to be used in lua
         // You don't need to store objects of this class, just call the register_type function
         template<class TClass>
         class TypeWrapper {
             lua_State* L;
+            bool deferred = false; // Bindings in the type table are only recorded and created on first use (only for deferred types)
+            int typeTableIdx = 0; // Absolute indices of the type table and the metatable if they are already on the stack (only when used by TypeBuilder)
+            int metatableIdx = 0;
 
-            void add_constructor_impl(lua_CFunction constructionFunction) const noexcept {
+            template<class>
+            friend class lua_w::TypeBuilder;
+
+            // Used by TypeBuilder when the type tables were just created (the bindings are set without looking the tables up)
+            TypeWrapper(lua_State* L, int typeTableIdx, int metatableIdx) noexcept : L(L), typeTableIdx(typeTableIdx), metatableIdx(metatableIdx) {}
+
+            // Pushes the metatable of the type
+            void push_metatable() const noexcept {
+                if (metatableIdx)
+                    lua_pushvalue(L, metatableIdx);
+                else
+                    luaL_getmetatable(L, TClass::lua_type_name());
+            }
+
+            // Pushes the type table
+            void push_type_table() const noexcept {
+                if (typeTableIdx) {
+                    lua_pushvalue(L, typeTableIdx);
+                    return;
+                }
                 luaL_getmetatable(L, TClass::lua_type_name());
                 lua_getfield(L, -1, "__index"); // __index field is the type table
+                lua_remove(L, -2);
+            }
+
+            // Adds a binding to the type table. 'pushBinding' has to leave the bound value on top of the stack
+            // 'kind' and 'ptr' identify the binding for deferred types
+            template<typename TPtr, typename TPush>
+            void add_to_type_table(const char* name, char kind, TPtr ptr, const TPush& pushBinding) const noexcept {
+                if (deferred) {
+                    // Only the descriptor is recorded (once for all states), the closure is created by 'deferred_index'
+                    // The same binding can be recorded again, but a different one can't replace it, because other states may have already created it
+                    enum { recorded, conflicting, outOfMemory } result = recorded;
+                    try {
+                        std::string identity(1 + sizeof(TPtr), kind);
+                        std::memcpy(&identity[1], &ptr, sizeof(TPtr));
+                        DeferredBindings& bindings = deferred_bindings<TClass>();
+                        std::lock_guard<std::mutex> lock(bindings.mutex);
+                        auto [it, inserted] = bindings.bindings.try_emplace(name);
+                        if (inserted)
+                            it->second = DeferredBinding{ std::move(identity), BindingPush_t(pushBinding) };
+                        else if (it->second.identity != identity)
+                            result = conflicting;
+                    } catch (const std::bad_alloc&) {
+                        result = outOfMemory;
+                    }
+                    // Errors are raised after the lock is released
+                    if (result == conflicting)
+                        luaL_error(L, "binding '%s' of deferred type '%s' is already registered differently", name, TClass::lua_type_name());
+                    else if (result == outOfMemory)
+                        luaL_error(L, "not enough memory"); // Same as when Lua fails to allocate
+                    return;
+                }
+                push_type_table();
+                pushBinding(L);
+                lua_setfield(L, -2, name);
+                lua_pop(L, 1); // Pop the type table
+            }
+
+            void add_constructor_impl(lua_CFunction constructionFunction) const noexcept {
+                push_type_table();
                 get_type_table_metatable(); // Metatable for the '__call metamethod
                 lua_pushcfunction(L, constructionFunction); // Push the construction function
                 lua_setfield(L, -2, "__call");
-                lua_pop(L, 3); // Pop the metatable,  the type table and it's metatable
+                lua_pop(L, 2); // Pop the type table and it's metatable
             }
         
             // Pushes the metatable on the stack (will create one if it doesn't exist) 
@@ -614,43 +1836,35 @@ namespace lua_w
                 }
             }
         public:
-            TypeWrapper(lua_State* L) : L(L) {
+            TypeWrapper(lua_State* L, bool deferred = false) : L(L) {
                 // Name of the type from the required static method
                 // This is required for pushing userdata to the stack
                 constexpr const char* name = TClass::lua_type_name();
                 
                 // Check if the type exists
+                int top = lua_gettop(L);
                 if (luaL_getmetatable(L, name) == LUA_TTABLE) {
                     // If there is a metatable named the same as this type, we assume that this type is already registered
-                    // Pop the value to clear the stack and return form the constructor
-                    lua_pop(L, 1);
+                    // If it was registered as deferred, new bindings are added to it's descriptors
+                    lua_getfield(L, -1, "__index");
+                    if (lua_getmetatable(L, -1) && lua_getfield(L, -1, "__index") == LUA_TFUNCTION)
+                        this->deferred = lua_tocfunction(L, -1) == &deferred_index<TClass>;
+                    lua_settop(L, top);
                     return;
                 }
 
-                lua_newtable(L); // Create a new table for the type
-                lua_pushvalue(L, -1);
-                lua_setglobal(L, name); // Set the type table as a global (for access to static method)
-
-                luaL_newmetatable(L, name); // Register a metatable for the type
-                lua_pushvalue(L, -2);
-                lua_setfield(L, -2, "__index"); // Set the type table as the __index function (objects will look for method in this table)
+                create_type_tables<TClass>(L, 0, 0);
 
-                // Add a destructor in the __gc metamethod if the object requires it
-                if constexpr (!std::is_trivially_destructible_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        TClass* ptr = (TClass*)lua_touserdata(L, 1);
-                        ptr->~TClass();
-                        return 0;
-                    });
-                    lua_setfield(L, -2, "__gc"); // Set the __gc metatable field to the destructor call
+                if (deferred) {
+                    // Missing keys in the type table will be resolved from the recorded descriptors
+                    lua_pushvalue(L, -2);
+                    get_type_table_metatable();
+                    this->deferred = true;
+                    lua_pushcfunction(L, &deferred_index<TClass>);
+                    lua_setfield(L, -2, "__index");
+                    lua_pop(L, 2); // Pop the type table and it's metatable
                 }
 
-                lua_pushstring(L, name);
-                lua_setfield(L, -2, "__name");
-
-                lua_pushliteral(L, "Can't access the metatable of a registered type");
-                lua_setfield(L, -2, "__metatable");
-
                 lua_pop(L, 3); // Pop the type table, the metatable, and the nil that was given when checking if type was registerd
             }
 
@@ -658,20 +1872,8 @@ namespace lua_w
             // Constructor has to be added last
             // If you only want a default constructor then don't pass any types to this method
             template<typename... TArgs>
-            void add_constructor() const noexcept {				
-                add_constructor_impl([](lua_State* L) -> int {
-                    int argCounter = 2; // Omit the first argument (it's the type table)
-                    try {
-                        TClass* ptr = (TClass*)lua_newuserdatauv(L, sizeof(TClass), 0); // Allocate memory for the object
-                        new(ptr) TClass{ internal::stack_get<TArgs>(L, argCounter++).value() ... }; // Call a inplace new constructor (Creates the object on the specified addres)
-                        luaL_setmetatable(L, TClass::lua_type_name()); // Get the metatable and assign it to the created object
-                        return 1;
-                    } catch (const lua_w::internal::Error& e) {
-                        luaL_typeerror(L, argCounter - 1, e.type());
-                        return 0;
-                    }
-                });
-                
+            void add_constructor() const noexcept {
+                add_constructor_impl(&construct<TClass, TArgs...>);
             }
 
             // Adds a custom AND a default constructor (with no parameters)'
@@ -680,131 +1882,14 @@ namespace lua_w
             template<typename... TArgs>
             void add_custom_and_default_constructors() const noexcept {
                 static_assert(std::is_default_constructible_v<TClass>, "'TClass' is not default constructible");
-                add_constructor_impl([](lua_State* L) -> int {
-                    int argCounter = 2; // Omit the first argument (it's the type table)
-                    try {
-                        TClass* ptr = (TClass*)lua_newuserdatauv(L, sizeof(TClass), 0); // Allocate memory for the object
-                        if (lua_gettop(L) == 2) // Check if no arguments were passed first is the type table second is the created userdata
-                            new(ptr) TClass(); // Call a default constructor (if no arguments were passed)
-                        else
-                            new(ptr) TClass{ internal::stack_get<TArgs>(L, argCounter++) ... }; // Call a inplace new constructor (Creates the object on the specified addres)
-                        luaL_setmetatable(L, TClass::lua_type_name()); // Get the metatable and assign it to the created object
-                        return 1;
-                    } catch (const lua_w::internal::Error& e) {
-                        luaL_typeerror(L, argCounter - 1, e.type());
-                        return 0;
-                    }
-                });
+                add_constructor_impl(&construct_with_default<TClass, TArgs...>);
             }
 
             // Adds detected operators to the type
             // For a operator to be detected it has to take this type as the right and left side of the operator
             const TypeWrapper& add_detected_operators() const noexcept {
-                luaL_getmetatable(L, TClass::lua_type_name());
-
-                // Register the add operator
-                if constexpr (has_add_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        internal::stack_push<TClass>(L, *lhs + *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__add");
-                }
-
-                // Register the subtract operator
-                if constexpr (has_sub_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        internal::stack_push<TClass>(L, *lhs - *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__sub");
-                }
-
-                // Register the multiply operator
-                if constexpr (has_mult_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        internal::stack_push<TClass>(L, *lhs * *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__mul");
-                }
-
-                // Register the multiply operator
-                if constexpr (has_div_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        internal::stack_push<TClass>(L, *lhs / *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__div");
-                }
-
-                // Register the unary minus
-                if constexpr (has_unary_minus_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1))
-                            return 0;
-                        TClass* obj = (TClass*)lua_touserdata(L, 1);
-                        internal::stack_push<TClass>(L, -*obj);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__unm");
-                }
-
-                // Register the equlality operator
-                if constexpr (has_eq_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        lua_pushboolean(L, *lhs == *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__eq");
-                }
-
-                // Register the less-than operator
-                if constexpr (has_lt_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        lua_pushboolean(L, *lhs < *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__lt");
-                }
-
-                // Register the less-than or equal operator
-                if constexpr (has_lt_v<TClass>) {
-                    lua_pushcfunction(L, [](lua_State* L) -> int {
-                        if (!lua_isuserdata(L, 1) || !lua_isuserdata(L, 2))
-                            return 0;
-                        TClass* lhs = (TClass*)lua_touserdata(L, 1);
-                        TClass* rhs = (TClass*)lua_touserdata(L, 2);
-                        lua_pushboolean(L, *lhs <= *rhs);
-                        return 1;
-                    });
-                    lua_setfield(L, -2, "__le");
-                }
-
+                push_metatable();
+                set_detected_operators<TClass>(L);
                 lua_pop(L, 1);
                 return *this;
             }
@@ -814,11 +1899,9 @@ namespace lua_w
             const TypeWrapper& add_method(const char* name, internal::MemberFuncPtr_t<TClass, TRet, TArgs...> methodPtr) const noexcept {
                 using StoreType = internal::MemberFuncPtrStore<TClass, TRet, TArgs...>;
                 using MethodType = internal::MemberFuncPtr_t<TClass, TRet, TArgs...>;
-                luaL_getmetatable(L, TClass::lua_type_name());
-                lua_getfield(L, -1, "__index"); // __index field is the type table
-                wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
-                lua_setfield(L, -2, name);
-                lua_pop(L, 2); // Pop the type table
+                add_to_type_table(name, 'm', methodPtr, [methodPtr](lua_State* L) {
+                    wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
+                });
                 return *this;
             }
 
@@ -828,11 +1911,9 @@ namespace lua_w
                 // Everything works the same as the non-const version
                 using StoreType = internal::MemberConstFuncPtrStore<TClass, TRet, TArgs...>;
                 using MethodType = internal::MemberConstFuncPtr_t<TClass, TRet, TArgs...>;
-                luaL_getmetatable(L, TClass::lua_type_name());
-                lua_getfield(L, -1, "__index");
-                wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
-                lua_setfield(L, -2, name);
-                lua_pop(L, 2);
+                add_to_type_table(name, 'c', methodPtr, [methodPtr](lua_State* L) {
+                    wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
+                });
                 return *this;
             }
 
@@ -841,7 +1922,7 @@ namespace lua_w
             const TypeWrapper& add_metamethod(const char* methodName, internal::MemberFuncPtr_t<TClass, TRet, TArgs...> methodPtr) const noexcept {
                 using StoreType = internal::MemberFuncPtrStore<TClass, TRet, TArgs...>;
                 using MethodType = internal::MemberFuncPtr_t<TClass, TRet, TArgs...>;
-                luaL_getmetatable(L, TClass::lua_type_name());
+                push_metatable();
                 wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
                 lua_setfield(L, -2, methodName);
                 lua_pop(L, 1);
@@ -853,7 +1934,7 @@ namespace lua_w
             const TypeWrapper& add_metamethod(const char* methodName, internal::MemberConstFuncPtr_t<TClass, TRet, TArgs...> methodPtr) const noexcept {
                 using StoreType = internal::MemberConstFuncPtrStore<TClass, TRet, TArgs...>;
                 using MethodType = internal::MemberConstFuncPtr_t<TClass, TRet, TArgs...>;
-                luaL_getmetatable(L, TClass::lua_type_name());
+                push_metatable();
                 wrap_method<StoreType, MethodType, TClass, TRet, TArgs...>(L, methodPtr);
                 lua_setfield(L, -2, methodName);
                 lua_pop(L, 1);
@@ -864,30 +1945,9 @@ namespace lua_w
             template<typename TProp>
             const TypeWrapper& add_member(const char* name, internal::MemberPtr_t<TClass, TProp> memberPtr) const noexcept {
                 // Assigning is the same as methods
-                using PtrStore_t = internal::MemberPtrStore<TClass, TProp>;
-                luaL_getmetatable(L, TClass::lua_type_name());
-                lua_getfield(L, -1, "__index");
-                auto store = (PtrStore_t*)lua_newuserdatauv(L, sizeof(PtrStore_t), 0);
-                store->ptr = memberPtr;
-                lua_pushcclosure(L, [](lua_State* L) -> int {
-                    TClass* self = (TClass*)lua_touserdata(L, 1);
-                    auto memberPtr = ((PtrStore_t*)lua_touserdata(L, lua_upvalueindex(1)))->ptr;
-                    // When there are no additional arguments on the stack we want to access the variable
-                    if (lua_gettop(L) < 2) {
-                        internal::stack_push(L, self->*memberPtr);
-                        return 1;
-                    } else {
-                        // We want to assign to it
-                        try {
-                            self->*memberPtr = internal::stack_get<TProp>(L, 2);
-                        } catch (const lua_w::internal::Error& e) {
-                            luaL_typeerror(L, 2, e.type());
-                        }
-                        return 0;
-                    }
-                }, 1);
-                lua_setfield(L, -2, name);
-                lua_pop(L, 2);
+                add_to_type_table(name, 'v', memberPtr, [memberPtr](lua_State* L) {
+                    wrap_member<TClass, TProp>(L, memberPtr);
+                });
                 return *this;
             }
 
@@ -895,11 +1955,9 @@ namespace lua_w
             template<typename TRet, typename... TArgs>
             const TypeWrapper& add_static_method(const char* name, internal::FuncPtr_t<TRet, TArgs...> methodPtr) const noexcept {
                 // Works the same as registering a normal function. The only difference is that this function will be called from the type table
-                luaL_getmetatable(L, TClass::lua_type_name());
-                lua_getfield(L, -1, "__index"); // __index field is the type table
-                wrap_function(L, methodPtr);
-                lua_setfield(L, -2, name);
-                lua_pop(L, 2);
+                add_to_type_table(name, 's', methodPtr, [methodPtr](lua_State* L) {
+                    wrap_function(L, methodPtr);
+                });
                 return *this;
             }
         
@@ -911,13 +1969,13 @@ namespace lua_w
                 static_assert(std::is_base_of_v<LuaBaseObject, TParentClass>, "'TParentClass' has to derive from 'LuaBaseObject' when 'LUA_W_NO_PTR_SAFETY' is NOT defined");
                 #endif
 
-                luaL_getmetatable(L, TClass::lua_type_name());
-                lua_getfield(L, -1, "__index"); // __index field is the type table
+                push_type_table();
                 get_type_table_metatable(); // Get (or add) the type's metatable
                 luaL_getmetatable(L, TParentClass::lua_type_name());
                 lua_getfield(L, -1, "__index"); // Get the parent type's type table
-                lua_setfield(L, -3, "__index"); // Set the __index field to look in the parent implementation
-                lua_pop(L, 4); // Pop the metatable, type table and it's metatable and parent's type table
+                // Set the __index field to look in the parent implementation (deferred types look there after checking their descriptors)
+                lua_setfield(L, -3, deferred ? "__parent" : "__index");
+                lua_pop(L, 3); // Pop the type table and it's metatable and the parent's metatable
                 return *this;
             }
         };
@@ -934,9 +1992,570 @@ namespace lua_w
         return internal::TypeWrapper<TClass>(L);
     }
 
-    // Overrides a global 'type' function. It will work the same as the regular 'type' function with the ability to detect custom types
-    void register_type_function(lua_State* L) noexcept;
-}
+    // Registers a C++ type in the lua VM with deferred bindings
+    // Methods, member variables and static methods are only recorded and their closures are created on the first lookup.
+    // Metamethods, operators and constructors are still added right away
+    // The recorded bindings belong to the C++ type, so they are shared by every state that registers it as deferred (also across threads)
+    // A name can't be bound to a different method or member later, doing so raises a Lua error
+    // Use this when a lot of types are bound, but scripts use only a few of them
+    // If the type is already registered in the state as a regular type, the bindings are added right away
+    template<class TClass>
+    internal::TypeWrapper<TClass> register_type_deferred(lua_State* L) noexcept {
+        static_assert(internal::has_lua_type_name_v<TClass>, "Class has to have a static 'static const char* lua_type_name()' method");
+        #ifndef LUA_W_NO_PTR_SAFETY
+        static_assert(std::is_base_of_v<LuaBaseObject, TClass>, "'TClass' has to derive from 'LuaBaseObject' when 'LUA_W_NO_PTR_SAFETY' is NOT defined");
+        #endif
+        return internal::TypeWrapper<TClass>(L, true);
+    }
+
+    // Collects the bindings of a type and registers all of them in one pass (similar to luaL_setfuncs)
+    // The type table and the metatable are created presized and every binding is set without looking the tables up again
+    // The calls are recorded and forwarded to the same TypeWrapper that 'register_type' returns
+    // The builder doesn't depend on a lua_State, so it can be filled once and applied to many states
+    template<class TClass>
+    class TypeBuilder {
+        static_assert(internal::has_lua_type_name_v<TClass>, "Class has to have a static 'static const char* lua_type_name()' method");
+        #ifndef LUA_W_NO_PTR_SAFETY
+        static_assert(std::is_base_of_v<LuaBaseObject, TClass>, "'TClass' has to derive from 'LuaBaseObject' when 'LUA_W_NO_PTR_SAFETY' is NOT defined");
+        #endif
+
+        // Calls recorded for the TypeWrapper of the type. They are forwarded to it when the builder is applied
+        using Call_t = std::function<void(const internal::TypeWrapper<TClass>&)>;
+        std::vector<Call_t> calls;
+        int typeFields = 0; // Counts of the bindings (for presizing the type table and the metatable)
+        int metaFields = 0;
+
+        template<typename TCall>
+        TypeBuilder& record(int typeCount, int metaCount, TCall&& call) {
+            calls.emplace_back(std::forward<TCall>(call));
+            typeFields += typeCount;
+            metaFields += metaCount;
+            return *this;
+        }
+    public:
+        // Registers a nonconst member function
+        template<typename TRet, typename... TArgs>
+        TypeBuilder& add_method(const char* name, internal::MemberFuncPtr_t<TClass, TRet, TArgs...> methodPtr) {
+            return record(1, 0, [name = std::string(name), methodPtr](const auto& type) { type.add_method(name.c_str(), methodPtr); });
+        }
+
+        // Registers a const member function
+        template<typename TRet, typename... TArgs>
+        TypeBuilder& add_method(const char* name, internal::MemberConstFuncPtr_t<TClass, TRet, TArgs...> methodPtr) {
+            return record(1, 0, [name = std::string(name), methodPtr](const auto& type) { type.add_method(name.c_str(), methodPtr); });
+        }
+
+        // Adds a custom definition for one of lua's metamethod
+        template<typename TRet, typename... TArgs>
+        TypeBuilder& add_metamethod(const char* methodName, internal::MemberFuncPtr_t<TClass, TRet, TArgs...> methodPtr) {
+            return record(0, 1, [name = std::string(methodName), methodPtr](const auto& type) { type.add_metamethod(name.c_str(), methodPtr); });
+        }
+
+        // Adds a custom definition for one of lua's metamethod (const method version)
+        template<typename TRet, typename... TArgs>
+        TypeBuilder& add_metamethod(const char* methodName, internal::MemberConstFuncPtr_t<TClass, TRet, TArgs...> methodPtr) {
+            return record(0, 1, [name = std::string(methodName), methodPtr](const auto& type) { type.add_metamethod(name.c_str(), methodPtr); });
+        }
+
+        // Registers a member variable
+        template<typename TProp>
+        TypeBuilder& add_member(const char* name, internal::MemberPtr_t<TClass, TProp> memberPtr) {
+            return record(1, 0, [name = std::string(name), memberPtr](const auto& type) { type.add_member(name.c_str(), memberPtr); });
+        }
+
+        // Registers a static function
+        template<typename TRet, typename... TArgs>
+        TypeBuilder& add_static_method(const char* name, internal::FuncPtr_t<TRet, TArgs...> methodPtr) {
+            return record(1, 0, [name = std::string(name), methodPtr](const auto& type) { type.add_static_method(name.c_str(), methodPtr); });
+        }
+
+        // Adds detected operators to the type
+        TypeBuilder& add_detected_operators() {
+            return record(0, 8, [](const auto& type) { type.add_detected_operators(); });
+        }
+
+        // Sets the parent type. The parent type has to be registered in the state before this builder is applied
+        template<class TParentClass>
+        TypeBuilder& add_parent_type() {
+            return record(0, 0, [](const auto& type) { type.template add_parent_type<TParentClass>(); });
+        }
+
+        // Adds a constructor with the specified types (if you only want a default constructor then don't pass any types)
+        template<typename... TArgs>
+        TypeBuilder& add_constructor() {
+            return record(0, 0, [](const auto& type) { type.template add_constructor<TArgs...>(); });
+        }
+
+        // Adds a custom AND a default constructor (with no parameters)
+        template<typename... TArgs>
+        TypeBuilder& add_custom_and_default_constructors() {
+            return record(0, 0, [](const auto& type) { type.template add_custom_and_default_constructors<TArgs...>(); });
+        }
+
+        // Registers the type with all of the collected bindings in the passed state
+        // If the type is already registered in this state nothing happens
+        void apply(lua_State* L) const noexcept {
+            if (luaL_getmetatable(L, TClass::lua_type_name()) != LUA_TNIL) {
+                lua_pop(L, 1);
+                return;
+            }
+            lua_pop(L, 1);
+            apply_unchecked(L);
+        }
+
+        // Registers the type without checking if it was already registered
+        // Only use this on states where the type is known to be missing (eg. freshly created ones)
+        void apply_unchecked(lua_State* L) const noexcept {
+            build(L, true);
+            lua_pop(L, 1); // Pop the type table
+        }
+
+        // Registers the type (if it isn't registered yet) without setting it as a global and LEAVES it's type table on top of the stack
+        void push_type_table(lua_State* L) const noexcept {
+            if (luaL_getmetatable(L, TClass::lua_type_name()) != LUA_TNIL) {
+                lua_getfield(L, -1, "__index");
+                lua_remove(L, -2);
+                return;
+            }
+            lua_pop(L, 1);
+            build(L, false);
+        }
+    private:
+        // Creates the type tables, sets all bindings and LEAVES the type table on top of the stack
+        void build(lua_State* L, bool setGlobal) const noexcept {
+            internal::create_type_tables<TClass>(L, typeFields, metaFields, setGlobal);
+            int metatableIdx = lua_gettop(L);
+            internal::TypeWrapper<TClass> type(L, metatableIdx - 1, metatableIdx);
+            for (const auto& call : calls)
+                call(type);
+            lua_pop(L, 1); // Pop the metatable, the type table is on top now
+        }
+    };
+
+    // A recorded list of bindings (types and functions) that can be replayed into many states
+    // Use it when a lot of states with identical bindings are created. Everything is captured once and every replay
+    // is a single presized pass per type with no lookups of already registered types
+    class BindingSet {
+        std::vector<std::function<void(lua_State*)>> steps; // Replayed in the order of registration
+    public:
+        // Records a type. Returns a builder for adding the bindings of the type (same API as 'register_type')
+        // Parent types have to be recorded before their children
+        template<class TClass>
+        TypeBuilder<TClass>& register_type() {
+            auto builder = std::make_shared<TypeBuilder<TClass>>();
+            steps.emplace_back([builder](lua_State* L) { builder->apply_unchecked(L); });
+            return *builder;
+        }
+
+        // Records a C function of arbitrary signature that will be registered as a global Lua function
+        template<typename TRet, typename... TArgs>
+        BindingSet& register_function(const char* funcName, internal::FuncPtr_t<TRet, TArgs...> funcPtr) {
+            steps.emplace_back([name = std::string(funcName), funcPtr](lua_State* L) {
+                wrap_function(L, funcPtr);
+                lua_setglobal(L, name.c_str());
+            });
+            return *this;
+        }
+
+        // Registers everything that was recorded in the passed state
+        // The state should be fresh (none of the recorded types registered yet), as there are no checks for that
+        void replay(lua_State* L) const noexcept {
+            for (const auto& step : steps)
+                step(L);
+        }
+    };
+
+    //----------------------------
+    // MODULES
+    //----------------------------
+
+    // Collects bindings into a module table that scripts load with 'require' (eg. 'local engine = require "engine"')
+    // Nothing is added to the globals and the module is only built (in one presized pass) when it's first required
+    // The module doesn't depend on a lua_State, so it can be installed in many states
+    class Module {
+        using Binding = std::pair<std::string, internal::BindingPush_t>;
+        std::shared_ptr<std::vector<Binding>> bindings = std::make_shared<std::vector<Binding>>();
+
+        // Builds the module table (called by 'require'). Upvalue 1 is a userdata that holds the bindings
+        static int load(lua_State* L) {
+            const auto& bindings = **(std::shared_ptr<std::vector<Binding>>*)lua_touserdata(L, lua_upvalueindex(1));
+            lua_createtable(L, 0, (int)bindings.size());
+            for (const auto& binding : bindings) {
+                binding.second(L);
+                lua_setfield(L, -2, binding.first.c_str());
+            }
+            return 1;
+        }
+    public:
+        // Adds a C function of arbitrary signature to the module
+        template<typename TRet, typename... TArgs>
+        Module& add_function(const char* name, internal::FuncPtr_t<TRet, TArgs...> funcPtr) {
+            bindings->emplace_back(name, [funcPtr](lua_State* L) { wrap_function(L, funcPtr); });
+            return *this;
+        }
+
+        // Adds a copy of the value to the module
+        template<typename TValue>
+        Module& add_value(const char* name, const TValue& value) {
+            bindings->emplace_back(name, [value](lua_State* L) { internal::stack_push(L, value); });
+            return *this;
+        }
+
+        // Adds a type to the module. Returns a builder for adding the bindings of the type (same API as 'register_type')
+        // The type table will be a field of the module instead of a global. If the type is already registered, it's type table is used
+        template<class TClass>
+        TypeBuilder<TClass>& add_type(const char* name = TClass::lua_type_name()) {
+            auto builder = std::make_shared<TypeBuilder<TClass>>();
+            bindings->emplace_back(name, [builder](lua_State* L) { builder->push_type_table(L); });
+            return *builder;
+        }
+
+        // Makes the module available to 'require' under the passed name (by adding it to 'package.preload')
+        // Bindings added after this call will still be a part of the module, if it wasn't required yet
+        void install(lua_State* L, const char* moduleName) const noexcept {
+            luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+            auto store = (std::shared_ptr<std::vector<Binding>>*)lua_newuserdatauv(L, sizeof(bindings), 0);
+            new(store) std::shared_ptr<std::vector<Binding>>(bindings);
+            if (luaL_newmetatable(L, "LUA_W_MODULE")) {
+                lua_pushcfunction(L, [](lua_State* L) -> int {
+                    using Store_t = std::shared_ptr<std::vector<Binding>>;
+                    ((Store_t*)lua_touserdata(L, 1))->~Store_t();
+                    return 0;
+                });
+                lua_setfield(L, -2, "__gc");
+            }
+            lua_setmetatable(L, -2);
+            lua_pushcclosure(L, &Module::load, 1);
+            lua_setfield(L, -2, moduleName);
+            lua_pop(L, 1); // Pop package.preload
+        }
+    };
+
+    // Overrides a global 'type' function. It will work the same as the regular 'type' function with the ability to detect custom types
+    void register_type_function(lua_State* L) noexcept;
+
+    // Adds numeric array functions of tables to the 'table' library (creates the library's table if it doesn't exist):
+    // 'table.sort_numeric(t [, descending])', 'table.sum(t)', 'table.min_max(t)' (returns nothing for empty arrays),
+    // 'table.binary_search(t, value)' (returns the index or nil) and 'table.unique(t)' (returns the new length)
+    void register_table_functions(lua_State* L) noexcept;
+
+    //----------------------------
+    // MODULE BUNDLES
+    //----------------------------
+
+    // A bundle is a single blob with an index and concatenated chunks (source code or bytecode)
+    // Layout (all integers are little endian):
+    // "LUAWBNDL" | u32 module count | for every module: u32 name length, u64 chunk offset, u64 chunk size, name | chunks
+    // Chunk offsets are counted from the start of the chunk section
+
+    // Creates a bundle form pairs of (module name, chunk)
+    // Chunks can be source code or precompiled bytecode (eg. from string.dump or luac)
+    // Throws an exception for duplicate module names and when the counts or name lengths don't fit in the index
+    std::string make_bundle(const std::vector<std::pair<std::string, std::string>>& modules);
+
+    // Reads a bundle file and installs a searcher for it at the front of 'package.searchers'
+    // After this 'require' resolves modules form the bundle with a single hash lookup (no filesystem access)
+    // The package library has to be opened. Throws an exception if the file can't be read or isn't a valid bundle
+    void add_bundle_searcher(lua_State* L, const char* bundlePath);
+
+    // Installs a searcher for a bundle that is already in memory (eg. embedded in the executable or memory mapped by the caller)
+    // The data is NOT copied and chunks are loaded directly from it, so it has to outlive the lua_State
+    void add_bundle_searcher(lua_State* L, const char* data, size_t size);
+
+    //----------------------------
+    // STATE BASELINES
+    //----------------------------
+
+    // Records the state after initialisation and allows rolling it back, so script runs can be isolated without creating a new state for each of them
+    // Recorded are: globals, string keys of the registry (metatables), package.loaded, loaded libraries, metatables with their type tables and the string metatable
+    class Baseline {
+        std::shared_ptr<internal::LuaObjectReference> snapshotPtr;
+    public:
+        // Records the current contents of the state. lua_w::init has to be called first
+        Baseline(lua_State* L);
+
+        // Removes everything that was added and restores everything that was modified in the recorded tables (including their metatables)
+        // and then runs a full garbage collection cycle
+        // Tables that weren't recorded (eg. tables created by scripts and stored in globals) are not rolled back, only the references to them
+        void reset(lua_State* L) const noexcept;
+    };
+
+    //----------------------------
+    // STATE SNAPSHOTS
+    //----------------------------
+
+    // Writes the values of the passed globals (roots) and everything reachable form them
+    // Supported are: nil, booleans, numbers, strings, tables (with shared references, cycles and metatables),
+    // Lua functions (as bytecode with their upvalues) and registered types that have serialisation hooks:
+    // 'void lua_serialise(const lua_w::Writer&) const' and 'static TClass lua_deserialise(const lua_w::Reader&)'
+    // The globals table and metatables of registered types are stored as references, so they are not copied
+    // Throws an exception when an unsupported value (eg. a C function) is reachable
+    void snapshot(lua_State* L, const Writer& writer, const std::vector<std::string>& roots);
+
+    // Reads a snapshot and sets all of it's roots as globals. Registered types used in the snapshot have to be registered in the state
+    // Throws an exception if the snapshot is invalid
+    void restore(lua_State* L, const Reader& reader);
+
+    //----------------------------
+    // ENVIRONMENTS
+    //----------------------------
+
+    // A table used as '_ENV' of scripts, so every script can have it's own global namespace in a single state
+    // Derived environments copy nothing. Missing globals are looked up in the environment they were derived from (through '__index')
+    class Environment {
+        std::shared_ptr<internal::LuaObjectReference> envPtr;
+        Environment(const std::shared_ptr<internal::LuaObjectReference>& ref) : envPtr(ref) {}
+    public:
+        // Creates a read-only base environment that can be shared by many scripts
+        // It contains a safe subset of the base library (no load, dofile, require, rawset...) and read-only views of the passed libs (same flags as in open_libs)
+        // Tables reachable through the views are read-only views too and 'getmetatable' doesn't return the metatables shared by the state (eg. of strings)
+        // Libraries that aren't opened in the state are opened without setting their globals. The base library has to be opened in the state
+        // The package library is rejected (an exception is thrown), as through package.loaded scripts could reach every library and 'load'
+        static Environment create_base(lua_State* L, uint16_t libs);
+
+        // Creates an empty environment that reads missing globals from this one. Scripts' writes only go to the new environment
+        Environment derive() const;
+
+        // Pushes the environment table on to the stack
+        // No need to use this function on it's own
+        void push_to_stack(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, envPtr->get_object_id());
+        }
+
+        // Returns a global form this environment (or the ones it was derived from)
+        template<typename TValue>
+        TValue get(const char* name) const {
+            lua_State* L = envPtr->L;
+            push_to_stack(L);
+            lua_getfield(L, -1, name);
+            try {
+                auto value = internal::stack_get<TValue>(L, -1);
+                lua_pop(L, 2);
+                return value;
+            } catch (...) {
+                lua_pop(L, 2);
+                throw;
+            }
+        }
+
+        // Sets a global in this environment. This also works for the read-only base environments (eg. to add shared bindings)
+        template<typename TValue>
+        void set(const char* name, const TValue& value) const noexcept {
+            lua_State* L = envPtr->L;
+            push_to_stack(L);
+            lua_pushstring(L, name);
+            internal::stack_push(L, value);
+            lua_rawset(L, -3); // Raw set, so base environments don't reject it
+            lua_pop(L, 1);
+        }
+    };
+
+    // Loads a script (without running it) and returns it as a function that uses the passed environment as it's globals
+    // Throws an exception when the script has syntax errors
+    Function load_script(lua_State* L, const char* code, const Environment& env);
+
+    // Loads a script (without running it) and returns it as a function that uses the regular globals
+    // Throws an exception when the script has syntax errors
+    Function load_script(lua_State* L, const char* code);
+
+    //----------------------------
+    // TRANSFERS BETWEEN STATES
+    //----------------------------
+
+    // Deep copies the table at 'idx' in the 'from' state to the 'to' state and returns it as a table in the 'to' state
+    // Copied are: numbers, strings, booleans, light userdata, nested tables (shared references and cycles are preserved)
+    // and registered types (using their copy constructors, the type has to be registered in both states). Metatables of tables are not copied
+    // The 'to' state has to be initialized with lua_w::init. Throws an exception when an unsupported value (eg. a function) is found
+    Table transfer(lua_State* from, int idx, lua_State* to);
+
+    //----------------------------
+    // MESSAGEPACK
+    //----------------------------
+
+    // Encodes the value at 'idx' in the MessagePack format
+    // Tables that have only the keys 1..n are encoded as arrays (empty tables too), other tables as maps. Integers and floats are kept apart
+    // Registered types with serialisation hooks are encoded as an extension (type 1) holding the type name and the output of the hook
+    // Throws an exception for values that can't be encoded (functions, threads, other userdata and tables nested too deeply or with cycles)
+    void encode(lua_State* L, int idx, const Writer& writer);
+
+    // Decodes one MessagePack value and pushes it on to the stack. Binary data is decoded as strings
+    // Throws an exception when the data is invalid or the reader runs out of data
+    void decode(lua_State* L, const Reader& reader);
+
+    // Sets a global 'msgpack' table with two functions:
+    // 'msgpack.encode(value)' that returns a string and 'msgpack.decode(string)' that returns the value
+    void register_msgpack_functions(lua_State* L) noexcept;
+
+    //----------------------------
+    // JSON
+    //----------------------------
+
+    // Parses JSON and pushes the value on to the stack. Objects and arrays are created presized
+    // Numbers without a fraction and an exponent become integers (if they fit), 'null' becomes nil
+    // Throws an exception (with the position of the error) when the JSON is invalid
+    void push_json(lua_State* L, std::string_view json);
+
+    // Parses a JSON object or array and returns it as a table
+    Table from_json(lua_State* L, std::string_view json);
+
+    // Converts Lua values to JSON. The output buffer is reused between calls, so one encoder should be kept for repeated encoding
+    // Tables that have only the keys 1..n are encoded as arrays (empty tables too), other tables as objects (with string or number keys)
+    class JsonEncoder {
+        std::string buffer;
+        int depth = 0;
+
+        void write_value(lua_State* L, int idx);
+        void write_string(const char* str, size_t length);
+        void write_table(lua_State* L, int idx);
+    public:
+        // Encodes the value at 'idx'. The returned view is valid until the next call
+        // Throws an exception for values that can't be represented (functions, userdata, NaN, tables nested too deeply or with cycles)
+        std::string_view encode(lua_State* L, int idx);
+    };
+
+    // Sets a global 'json' table with two functions:
+    // 'json.encode(value)' that returns a string and 'json.decode(string)' that returns the value
+    void register_json_functions(lua_State* L) noexcept;
+
+    //----------------------------
+    // OBSERVED TABLES
+    //----------------------------
+
+    // A table that records which keys were changed by scripts, so C++ can synchronise only the changes
+    // Scripts get an empty proxy table. Reads go to a hidden storage table (through '__index') and writes go through '__newindex',
+    // which stores the value and records the key. Keys are recorded as strings (numbers are converted), other keys aren't tracked
+    // Only direct assignments are tracked (changes inside nested tables are not) and writing the same value doesn't mark the key
+    // The proxy's metatable is protected ('__metatable'), the handle keeps working even if it is removed (eg. with 'debug.setmetatable')
+    class ObservedTable {
+        std::shared_ptr<internal::LuaObjectReference> proxyPtr; // Table: { proxy, storage }
+        std::shared_ptr<std::unordered_set<std::string>> changed; // Shared with the userdata used by the proxy's '__newindex'
+    public:
+        // Creates a new, empty observed table
+        ObservedTable(lua_State* L);
+
+        // Pushes the proxy table on to the stack
+        // No need to use this function on it's own
+        void push_to_stack(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, proxyPtr->get_object_id());
+            lua_rawgeti(L, -1, 1);
+            lua_remove(L, -2);
+        }
+
+        // Returns the storage table (changes made through it are not tracked)
+        Table storage() const noexcept;
+
+        // Returns a value from the storage table
+        template<typename TValue>
+        TValue get(const char* key) const {
+            lua_State* L = proxyPtr->L;
+            push_storage(L);
+            lua_getfield(L, -1, key);
+            try {
+                auto value = internal::stack_get<TValue>(L, -1);
+                lua_pop(L, 2);
+                return value;
+            } catch (...) {
+                lua_pop(L, 2);
+                throw;
+            }
+        }
+
+        // Sets a value without marking it as changed (eg. when C++ is the source of the change)
+        template<typename TValue>
+        void set(const char* key, const TValue& value) const noexcept {
+            lua_State* L = proxyPtr->L;
+            push_storage(L);
+            internal::stack_push(L, value);
+            lua_setfield(L, -2, key);
+            lua_pop(L, 1);
+        }
+
+        // Returns true if any key was changed since the last drain
+        bool has_changes() const noexcept {
+            return !changed->empty();
+        }
+
+        // Returns the changed keys and clears them
+        std::vector<std::string> drain_changes();
+    private:
+        void push_storage(lua_State* L) const noexcept {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, proxyPtr->get_object_id());
+            lua_rawgeti(L, -1, 2);
+            lua_remove(L, -2);
+        }
+    };
+
+    //----------------------------
+    // TABLE CURSORS
+    //----------------------------
+
+    // Iterates over a table in slices, so big tables can be processed over many frames
+    // The table and the current key are kept in a registry slot between the calls
+    // Like with 'next' existing fields can be modified or cleared between the slices, but new keys can't be added
+    class TableCursor {
+        std::shared_ptr<internal::LuaObjectReference> statePtr; // Table: { table, current key }
+        bool done = false;
+
+        template<typename TKey, typename TValue, typename Function, typename Predicate>
+        bool advance_while(const Function& function, const Predicate& shouldContinue) {
+            static_assert(internal::for_each_matches_v<Function, TKey, TValue>, "The cursor callable can't be called with the 'TKey', and 'TValue' types");
+            if (done)
+                return true;
+            lua_State* L = statePtr->L;
+            lua_rawgetp(L, LUA_REGISTRYINDEX, statePtr->get_object_id());
+            lua_rawgeti(L, -1, 1);
+            lua_rawgeti(L, -2, 2);
+            try {
+                size_t count = 0;
+                while (shouldContinue(count)) {
+                    if (lua_next(L, -2) == 0) {
+                        done = true;
+                        lua_pushnil(L); // The key that will be saved
+                        break;
+                    }
+                    function(internal::stack_get<TKey>(L, -2), internal::stack_get<TValue>(L, -1));
+                    lua_pop(L, 1);
+                    count++;
+                }
+            } catch (...) {
+                // The key of the failed entry is saved, so the entry is skipped when advancing again
+                lua_settop(L, lua_gettop(L) - 1);
+                lua_rawseti(L, -3, 2);
+                lua_pop(L, 2);
+                throw;
+            }
+            lua_rawseti(L, -3, 2);
+            lua_pop(L, 2);
+            return done;
+        }
+    public:
+        // Creates a cursor at the start of the table
+        TableCursor(lua_State* L, const Table& table);
+
+        // Calls the function for at most 'maxItems' entries. Returns true if the whole table was traversed
+        template<typename TKey, typename TValue, typename Function>
+        bool advance(size_t maxItems, const Function& function) {
+            return advance_while<TKey, TValue>(function, [maxItems](size_t count) { return count < maxItems; });
+        }
+
+        // Calls the function until the deadline passes. Returns true if the whole table was traversed
+        // The clock is checked every few entries, so the function should be cheap compared to the length of the slice
+        template<typename TKey, typename TValue, typename Function>
+        bool advance_until(std::chrono::steady_clock::time_point deadline, const Function& function) {
+            return advance_while<TKey, TValue>(function, [deadline](size_t count) {
+                return count % 16 != 0 || std::chrono::steady_clock::now() < deadline;
+            });
+        }
+
+        // Returns true if the whole table was traversed
+        bool finished() const noexcept {
+            return done;
+        }
+
+        // Moves the cursor back to the start of the table
+        void reset() noexcept;
+    };
+}
 #endif // End of LUA_W_INCLUDE_H
 
 #ifdef LUA_W_IMPLEMENTATION
@@ -953,21 +2572,115 @@ const char* lua_w::internal::Error::type() const {
     return typeName;
 }
 
+namespace lua_w::internal {
+    // Flag, name and open function of every standard library
+    struct StdLib {
+        uint16_t flag;
+        const char* name;
+        lua_CFunction openFunc;
+    };
+
+    static const StdLib stdLibs[] = {
+        { Libs::base, LUA_GNAME, luaopen_base },                { Libs::coroutine, LUA_COLIBNAME, luaopen_coroutine },
+        { Libs::debug, LUA_DBLIBNAME, luaopen_debug },          { Libs::io, LUA_IOLIBNAME, luaopen_io },
+        { Libs::math, LUA_MATHLIBNAME, luaopen_math },          { Libs::os, LUA_OSLIBNAME, luaopen_os },
+        { Libs::package, LUA_LOADLIBNAME, luaopen_package },    { Libs::string, LUA_STRLIBNAME, luaopen_string },
+        { Libs::table, LUA_TABLIBNAME, luaopen_table },         { Libs::utf8, LUA_UTF8LIBNAME, luaopen_utf8 }
+    };
+
+    // Pushes the metatable of the globals table on to the stack (will create one if it doesn't exist)
+    static void push_globals_metatable(lua_State* L) noexcept {
+        lua_pushglobaltable(L);
+        if (!lua_getmetatable(L, -1)) {
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setmetatable(L, -3);
+        }
+        lua_remove(L, -2); // Remove the globals table
+    }
+
+    // Looks up the key (at index 2) in whatever was in the '__index' field before our hook was installed (upvalue 'prevIdx')
+    static int chain_index(lua_State* L, int prevIdx) {
+        switch (lua_type(L, prevIdx)) {
+            case LUA_TFUNCTION:
+                lua_pushvalue(L, prevIdx);
+                lua_pushvalue(L, 1);
+                lua_pushvalue(L, 2);
+                lua_call(L, 2, 1);
+                return 1;
+            case LUA_TNIL:
+                return 0; // Nothing to chain to, so the result is nil
+            default:
+                lua_pushvalue(L, 2);
+                lua_gettable(L, prevIdx);
+                return 1;
+        }
+    }
+
+    // '__index' of the globals table. Opens a library when its global is accessed for the first time
+    // Upvalue 1 is the table of pending libraries (name -> open function), upvalue 2 is the previous '__index'
+    // Stubs are kept, so a library removed form the globals (eg. by Baseline::reset) is set again on the next access
+    static int lazy_libs_index(lua_State* L) {
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TFUNCTION) {
+            lua_CFunction openFunc = lua_tocfunction(L, -1);
+            lua_pop(L, 1);
+            // Sets the global and package.loaded (if the library was already loaded this only returns it, so it's never opened twice)
+            luaL_requiref(L, lua_tostring(L, 2), openFunc, 1);
+            return 1;
+        }
+        lua_pop(L, 1);
+        return chain_index(L, lua_upvalueindex(2));
+    }
+}
+
 void lua_w::open_libs(lua_State* L, uint16_t libs) noexcept {
-    int popCount = 0;
-    if (libs == Libs::all) { luaL_openlibs(L); }
-
-    if (libs & Libs::base)      { luaL_requiref(L, LUA_GNAME, luaopen_base, 1); ++popCount; }
-    if (libs & Libs::coroutine) { luaL_requiref(L, LUA_COLIBNAME, luaopen_coroutine, 1); ++popCount; }
-    if (libs & Libs::debug)     { luaL_requiref(L, LUA_DBLIBNAME, luaopen_debug, 1); ++popCount; }
-    if (libs & Libs::io)        { luaL_requiref(L, LUA_IOLIBNAME, luaopen_io, 1); ++popCount; }
-    if (libs & Libs::math)      { luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, 1); ++popCount; }
-    if (libs & Libs::os)        { luaL_requiref(L, LUA_OSLIBNAME, luaopen_os, 1); ++popCount; }
-    if (libs & Libs::package)   { luaL_requiref(L, LUA_LOADLIBNAME, luaopen_package, 1); ++popCount; }
-    if (libs & Libs::string)    { luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1); ++popCount; }
-    if (libs & Libs::table)     { luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1); ++popCount; }
-    if (libs & Libs::utf8)      { luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1); ++popCount; }
-    lua_pop(L, popCount);
+    if (libs == Libs::all) {
+        luaL_openlibs(L);
+        return;
+    }
+
+    for (const auto& lib : internal::stdLibs) {
+        if (libs & lib.flag) {
+            luaL_requiref(L, lib.name, lib.openFunc, 1);
+            lua_pop(L, 1);
+        }
+    }
+}
+
+void lua_w::open_libs_lazy(lua_State* L, uint16_t libs) noexcept {
+    // The base library lives in the globals table and package is needed to make 'require' work, so they are opened right away
+    open_libs(L, libs & (Libs::base | Libs::package));
+
+    lua_newtable(L); // Pending libraries
+    bool hasPackage = libs & Libs::package;
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    for (const auto& lib : internal::stdLibs) {
+        if (!(libs & lib.flag) || lib.flag == Libs::base || lib.flag == Libs::package)
+            continue;
+        lua_pushcfunction(L, lib.openFunc);
+        if (hasPackage) {
+            // 'require' can also open the library, the global stub will then pick up the same table
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, lib.name);
+        }
+        lua_setfield(L, -3, lib.name);
+    }
+    lua_pop(L, 1); // Pop package.preload
+
+    // Only the string library sets the metatable of strings, so it's loaded right away (but it's global is still set lazily)
+    // Without this method calls on strings would fail until the 'string' global is accessed
+    if (libs & Libs::string) {
+        luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 0);
+        lua_pop(L, 1);
+    }
+
+    internal::push_globals_metatable(L);
+    lua_pushvalue(L, -2); // Pending libraries
+    lua_getfield(L, -2, "__index"); // Previous '__index', we will fall back to it
+    lua_pushcclosure(L, &internal::lazy_libs_index, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 2); // Pop the metatable and the pending libraries
 }
 
 void lua_w::register_type_function(lua_State* L) noexcept {
@@ -980,4 +2693,2669 @@ void lua_w::register_type_function(lua_State* L) noexcept {
     });
     lua_setglobal(L, "type");
 }
+namespace lua_w::internal {
+    // Parsed bundle. It lives in a userdata that is the upvalue of the searcher
+    struct Bundle {
+        std::string storage; // Only used when the bundle was read form a file
+        const char* chunks = nullptr; // Start of the chunk section
+        std::unordered_map<std::string_view, std::pair<size_t, size_t>> index; // Module name -> (offset, size)
+    };
+
+    static constexpr char bundleMagic[] = "LUAWBNDL";
+    static constexpr size_t bundleMagicSize = sizeof(bundleMagic) - 1;
+
+    static uint64_t read_le(const char* ptr, int bytes) noexcept {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value |= (uint64_t)(unsigned char)ptr[i] << (8 * i);
+        return value;
+    }
+
+    static void write_le(std::string& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++)
+            out.push_back((char)((value >> (8 * i)) & 0xFF));
+    }
+
+    // Searcher function called by 'require'. Returns a loader or a message why the module wasn't found
+    static int bundle_searcher(lua_State* L) {
+        auto bundle = (Bundle*)lua_touserdata(L, lua_upvalueindex(1));
+        size_t nameLength;
+        const char* name = luaL_checklstring(L, 1, &nameLength);
+        auto it = bundle->index.find(std::string_view(name, nameLength));
+        if (it == bundle->index.end()) {
+            lua_pushfstring(L, "no module '%s' in bundle", name);
+            return 1;
+        }
+        lua_pushfstring(L, "@%s", name); // Chunk name, so errors in the module will point to it
+        // Chunks are loaded straight form the bundle memory (no copies are made)
+        if (luaL_loadbufferx(L, bundle->chunks + it->second.first, it->second.second, lua_tostring(L, -1), nullptr) != LUA_OK)
+            return luaL_error(L, "error loading module '%s' from bundle:\n\t%s", name, lua_tostring(L, -1));
+        lua_pushvalue(L, 1); // Extra value passed to the loader (regular searchers pass the file name)
+        return 2;
+    }
+
+    // Pushes a new, empty bundle userdata on to the stack
+    static Bundle* push_bundle(lua_State* L) {
+        auto bundle = (Bundle*)lua_newuserdatauv(L, sizeof(Bundle), 0);
+        new(bundle) Bundle();
+        if (luaL_newmetatable(L, "LUA_W_BUNDLE")) {
+            lua_pushcfunction(L, [](lua_State* L) -> int {
+                ((Bundle*)lua_touserdata(L, 1))->~Bundle();
+                return 0;
+            });
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        return bundle;
+    }
+
+    // Parses the bundle index, installs the searcher and pops the bundle userdata
+    static void install_bundle(lua_State* L, Bundle* bundle, const char* data, size_t size) {
+        // Every failure pops the userdata, so it will be garbage collected
+        auto fail = [L](const char* message) {
+            lua_pop(L, 1);
+            throw lua_w::internal::Error("bundle", message);
+        };
+
+        if (size < bundleMagicSize + 4 || std::memcmp(data, bundleMagic, bundleMagicSize) != 0)
+            fail("Data is not a lua_w bundle");
+        size_t pos = bundleMagicSize;
+        uint64_t count = read_le(data + pos, 4);
+        pos += 4;
+
+        // Every index entry takes at least 20 bytes, so a corrupted count is rejected before anything is allocated
+        if (count > (size - pos) / 20)
+            fail("Bundle index is truncated");
+        bundle->index.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            if (size - pos < 20)
+                fail("Bundle index is truncated");
+            size_t nameLength = read_le(data + pos, 4);
+            size_t offset = read_le(data + pos + 4, 8);
+            size_t chunkSize = read_le(data + pos + 12, 8);
+            pos += 20;
+            if (size - pos < nameLength)
+                fail("Bundle index is truncated");
+            if (!bundle->index.emplace(std::string_view(data + pos, nameLength), std::make_pair(offset, chunkSize)).second)
+                fail("Bundle has duplicate module names");
+            pos += nameLength;
+        }
+
+        // Validate all chunks at once, so the searcher doesn't have to
+        size_t chunkSectionSize = size - pos;
+        for (const auto& entry : bundle->index)
+            if (entry.second.first > chunkSectionSize || entry.second.second > chunkSectionSize - entry.second.first)
+                fail("Bundle chunk is out of bounds");
+        bundle->chunks = data + pos;
+
+        // package.searchers is taken form the loaded package library (so it works even if the 'package' global was removed)
+        int bundleIdx = lua_gettop(L);
+        luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+        if (lua_getfield(L, -1, LUA_LOADLIBNAME) != LUA_TTABLE || lua_getfield(L, -1, "searchers") != LUA_TTABLE) {
+            lua_settop(L, bundleIdx); // Leave only the bundle userdata
+            fail("The package library is not opened");
+        }
+
+        // Move all searchers one position up and put ours in front of them
+        for (lua_Integer i = (lua_Integer)lua_rawlen(L, -1); i >= 1; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushvalue(L, -4); // The bundle userdata
+        lua_pushcclosure(L, &bundle_searcher, 1);
+        lua_rawseti(L, -2, 1);
+        lua_pop(L, 4); // Pop searchers, package, the loaded table and the bundle
+    }
+}
+
+std::string lua_w::make_bundle(const std::vector<std::pair<std::string, std::string>>& modules) {
+    if (modules.size() > UINT32_MAX)
+        throw internal::Error("bundle", "Too many modules for a bundle");
+    std::unordered_set<std::string_view> names;
+    for (const auto& module : modules) {
+        if (module.first.size() > UINT32_MAX)
+            throw internal::Error("bundle", "Module name is too long for a bundle");
+        if (!names.emplace(module.first).second)
+            throw internal::Error("bundle", "Bundle has duplicate module names");
+    }
+
+    std::string index(internal::bundleMagic, internal::bundleMagicSize);
+    std::string chunks;
+    internal::write_le(index, modules.size(), 4);
+    for (const auto& module : modules) {
+        internal::write_le(index, module.first.size(), 4);
+        internal::write_le(index, chunks.size(), 8);
+        internal::write_le(index, module.second.size(), 8);
+        index += module.first;
+        chunks += module.second;
+    }
+    return index + chunks;
+}
+
+void lua_w::add_bundle_searcher(lua_State* L, const char* bundlePath) {
+    std::FILE* file = std::fopen(bundlePath, "rb");
+    if (!file)
+        throw internal::Error("bundle", "Can't open the bundle file");
+
+    // The whole file is read with a single call, modules are then loaded form this memory
+    std::string storage;
+    if (std::fseek(file, 0, SEEK_END) == 0) {
+        long size = std::ftell(file);
+        if (size > 0) {
+            storage.resize((size_t)size);
+            std::rewind(file);
+            if (std::fread(storage.data(), 1, storage.size(), file) != storage.size())
+                storage.clear();
+        }
+    }
+    std::fclose(file);
+
+    internal::Bundle* bundle = internal::push_bundle(L);
+    bundle->storage = std::move(storage);
+    internal::install_bundle(L, bundle, bundle->storage.data(), bundle->storage.size());
+}
+
+void lua_w::add_bundle_searcher(lua_State* L, const char* data, size_t size) {
+    internal::install_bundle(L, internal::push_bundle(L), data, size);
+}
+namespace lua_w::internal {
+    // Records a shallow copy and the metatable of the table at 'idx' in the snapshot table at 'snapIdx'
+    // Record layout: { copy, metatable, stringKeysOnly }
+    static void baseline_track(lua_State* L, int snapIdx, int idx, bool stringKeysOnly) noexcept {
+        idx = lua_absindex(L, idx);
+        lua_pushvalue(L, idx);
+        if (lua_rawget(L, snapIdx) != LUA_TNIL) { // Already recorded
+            lua_pop(L, 1);
+            return;
+        }
+        lua_pop(L, 1);
+
+        lua_createtable(L, 3, 0);
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            if (!stringKeysOnly || lua_type(L, -2) == LUA_TSTRING) {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, -4);
+            }
+            else
+                lua_pop(L, 1);
+        }
+        lua_rawseti(L, -2, 1);
+        if (lua_getmetatable(L, idx))
+            lua_rawseti(L, -2, 2);
+        lua_pushboolean(L, stringKeysOnly);
+        lua_rawseti(L, -2, 3);
+
+        lua_pushvalue(L, idx);
+        lua_insert(L, -2);
+        lua_rawset(L, snapIdx);
+    }
+
+    // Records every table value (and for metatables also the type table in '__index') of the table at 'idx'
+    static void baseline_track_values(lua_State* L, int snapIdx, int idx, bool withTypeTables) noexcept {
+        idx = lua_absindex(L, idx);
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+                baseline_track(L, snapIdx, -1, false);
+                if (withTypeTables) {
+                    lua_pushliteral(L, "__index");
+                    if (lua_rawget(L, -2) == LUA_TTABLE)
+                        baseline_track(L, snapIdx, -1, false);
+                    lua_pop(L, 1);
+                }
+            }
+            lua_pop(L, 1);
+        }
+    }
+}
+
+lua_w::Baseline::Baseline(lua_State* L) : snapshotPtr(std::make_shared<internal::LuaObjectReference>(L)) {
+    lua_newtable(L);
+    int snapIdx = lua_gettop(L);
+
+    // Only string keys of the registry are recorded, all other keys are references (eg. from lua_w::Table, or luaL_ref)
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    internal::baseline_track(L, snapIdx, -1, true);
+    internal::baseline_track_values(L, snapIdx, -1, true);
+    lua_pop(L, 1);
+
+    lua_pushglobaltable(L);
+    internal::baseline_track(L, snapIdx, -1, false);
+    lua_pop(L, 1);
+
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    internal::baseline_track_values(L, snapIdx, -1, false);
+    lua_pop(L, 1);
+
+    lua_pushliteral(L, "");
+    if (lua_getmetatable(L, -1)) {
+        internal::baseline_track(L, snapIdx, -1, false);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, snapshotPtr->get_object_id());
+}
+
+void lua_w::Baseline::reset(lua_State* L) const noexcept {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, snapshotPtr->get_object_id());
+    int snapIdx = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, snapIdx) != 0) {
+        // Stack: tracked table (key), record
+        int tableIdx = lua_gettop(L) - 1;
+        lua_rawgeti(L, -1, 1);
+        int copyIdx = lua_gettop(L);
+        lua_rawgeti(L, -2, 3);
+        bool stringKeysOnly = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        // Remove keys that were added (clearing existing fields during a traversal is allowed)
+        lua_pushnil(L);
+        while (lua_next(L, tableIdx) != 0) {
+            lua_pop(L, 1);
+            if (stringKeysOnly && lua_type(L, -1) != LUA_TSTRING)
+                continue;
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, copyIdx) == LUA_TNIL) {
+                lua_pushvalue(L, -2);
+                lua_pushnil(L);
+                lua_rawset(L, tableIdx);
+            }
+            lua_pop(L, 1);
+        }
+
+        // Restore modified and removed values
+        lua_pushnil(L);
+        while (lua_next(L, copyIdx) != 0) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, tableIdx);
+            if (!lua_rawequal(L, -1, -2)) {
+                lua_pushvalue(L, -3);
+                lua_pushvalue(L, -3);
+                lua_rawset(L, tableIdx);
+            }
+            lua_pop(L, 2);
+        }
+
+        // Restore the metatable (lua_setmetatable ignores the '__metatable' protection)
+        lua_rawgeti(L, -2, 2);
+        lua_setmetatable(L, tableIdx);
+
+        lua_pop(L, 2); // Pop the copy and the record, the tracked table stays as the key for lua_next
+    }
+    lua_pop(L, 1);
+
+    lua_gc(L, LUA_GCCOLLECT);
+}
+namespace lua_w::internal {
+    // Collects small writes and passes them to a Writer in bigger pieces
+    class OutputBuffer {
+        const Writer& writer;
+        char buffer[4096];
+        size_t used = 0;
+    public:
+        OutputBuffer(const Writer& writer) : writer(writer) {}
+
+        void write(const void* data, size_t size) {
+            if (size > sizeof(buffer) - used) {
+                flush();
+                if (size > sizeof(buffer)) {
+                    writer((const char*)data, size);
+                    return;
+                }
+            }
+            std::memcpy(buffer + used, data, size);
+            used += size;
+        }
+
+        void write_le(uint64_t value, int bytes) {
+            char data[8];
+            for (int i = 0; i < bytes; i++)
+                data[i] = (char)((value >> (8 * i)) & 0xFF);
+            write(data, bytes);
+        }
+
+        void write_be(uint64_t value, int bytes) {
+            char data[8];
+            for (int i = 0; i < bytes; i++)
+                data[i] = (char)((value >> (8 * (bytes - i - 1))) & 0xFF);
+            write(data, bytes);
+        }
+
+        void flush() {
+            if (used > 0)
+                writer(buffer, used);
+            used = 0;
+        }
+    };
+
+    // Reads 'length' bytes in pieces, so a corrupted length fails when the input ends instead of allocating all of it up front
+    static void read_in_chunks(const Reader& in, std::string& out, uint64_t length) {
+        constexpr uint64_t chunkSize = 1 << 16;
+        out.clear();
+        while (out.size() < length) {
+            size_t pos = out.size();
+            out.resize(pos + (size_t)std::min(length - pos, chunkSize));
+            in(out.data() + pos, out.size() - pos);
+        }
+    }
+
+    // Counts read from data are only trusted up to a limit when presizing
+    static int presize_from_data(uint64_t count) {
+        return (int)(count < (1 << 16) ? count : (1 << 16));
+    }
+
+    enum SnapshotTag : uint8_t {
+        snapNil, snapFalse, snapTrue, snapInteger, snapNumber, snapString, snapTable,
+        snapRef, snapGlobals, snapMetatable, snapFunction, snapObject
+    };
+
+    static constexpr char snapshotMagic[] = "LUAWSNAP";
+    static constexpr int snapshotMaxDepth = 1000; // Nesting of tables and functions (deeper values would overflow the C stack)
+
+    class SnapshotWriter {
+        lua_State* L;
+        OutputBuffer out;
+        Writer hookWriter; // Passed to serialisation hooks of registered types
+        int seenIdx; // Table of already written objects (object -> id)
+        int globalsIdx;
+        uint32_t nextId = 0;
+        int depth = 0;
+        std::unordered_map<void*, std::pair<uint32_t, int>> upvalues; // Upvalue id -> (function id, upvalue number) where it was first seen
+
+        // Returns true if the object was already written (and writes the reference to it), otherwise assigns it an id
+        bool write_ref_or_register(int idx) {
+            lua_pushvalue(L, idx);
+            if (lua_rawget(L, seenIdx) == LUA_TNUMBER) {
+                out.write_le(snapRef, 1);
+                out.write_le(lua_tointeger(L, -1), 4);
+                lua_pop(L, 1);
+                return true;
+            }
+            lua_pop(L, 1);
+            lua_pushvalue(L, idx);
+            lua_pushinteger(L, nextId++);
+            lua_rawset(L, seenIdx);
+            return false;
+        }
+
+        // Checks if the table at 'idx' is a metatable of a registered type (registry[__name] == table)
+        bool write_if_registered_metatable(int idx) {
+            lua_pushliteral(L, "__name");
+            if (lua_rawget(L, idx) != LUA_TSTRING) {
+                lua_pop(L, 1);
+                return false;
+            }
+            lua_pushvalue(L, -1);
+            lua_rawget(L, LUA_REGISTRYINDEX);
+            bool isRegistered = lua_rawequal(L, -1, idx);
+            lua_pop(L, 1);
+            if (isRegistered) {
+                out.write_le(snapMetatable, 1);
+                write_string(-1);
+            }
+            lua_pop(L, 1);
+            return isRegistered;
+        }
+
+        void write_function(int idx) {
+            if (lua_iscfunction(L, idx))
+                throw Error("snapshot", "C functions can't be stored in a snapshot");
+            if (write_ref_or_register(idx))
+                return;
+            uint32_t id = nextId - 1;
+
+            std::string bytecode;
+            lua_pushvalue(L, idx);
+            lua_dump(L, [](lua_State*, const void* data, size_t size, void* ud) -> int {
+                ((std::string*)ud)->append((const char*)data, size);
+                return 0;
+            }, &bytecode, 0);
+            lua_pop(L, 1);
+            out.write_le(snapFunction, 1);
+            out.write_le(bytecode.size(), 8);
+            out.write(bytecode.data(), bytecode.size());
+
+            int upvalueCount = 0;
+            while (lua_getupvalue(L, idx, upvalueCount + 1)) {
+                lua_pop(L, 1);
+                upvalueCount++;
+            }
+            out.write_le(upvalueCount, 1);
+            for (int i = 1; i <= upvalueCount; i++) {
+                // Upvalues shared between closures are written once and joined when restoring
+                auto inserted = upvalues.emplace(lua_upvalueid(L, idx, i), std::make_pair(id, i));
+                if (!inserted.second) {
+                    out.write_le(1, 1);
+                    out.write_le(inserted.first->second.first, 4);
+                    out.write_le(inserted.first->second.second, 1);
+                    continue;
+                }
+                out.write_le(0, 1);
+                lua_getupvalue(L, idx, i);
+                write_nested(-1);
+                lua_pop(L, 1);
+            }
+        }
+
+        // Writes a value stored in a table or a function
+        void write_nested(int idx) {
+            if (++depth > snapshotMaxDepth)
+                throw Error("snapshot", "Values are nested too deeply");
+            write_value(idx);
+            depth--;
+        }
+
+        void write_table(int idx) {
+            if (lua_rawequal(L, idx, globalsIdx)) {
+                out.write_le(snapGlobals, 1);
+                return;
+            }
+            if (write_if_registered_metatable(idx) || write_ref_or_register(idx))
+                return;
+
+            // Counts are used to presize the table when restoring
+            uint64_t count = 0;
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0) {
+                lua_pop(L, 1);
+                count++;
+            }
+            out.write_le(snapTable, 1);
+            out.write_le(lua_rawlen(L, idx), 8);
+            out.write_le(count, 8);
+
+            if (lua_getmetatable(L, idx)) {
+                write_nested(-1);
+                lua_pop(L, 1);
+            }
+            else
+                out.write_le(snapNil, 1);
+
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0) {
+                write_nested(-2);
+                write_nested(-1);
+                lua_pop(L, 1);
+            }
+        }
+
+        void write_object(int idx) {
+            if (luaL_getmetafield(L, idx, "__lua_w_serialise") != LUA_TLIGHTUSERDATA)
+                throw Error("snapshot", "Only registered types with serialisation hooks can be stored in a snapshot");
+            auto serialise = (SerialiseFunc_t)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if (write_ref_or_register(idx))
+                return;
+            out.write_le(snapObject, 1);
+            luaL_getmetafield(L, idx, "__name");
+            write_string(-1);
+            lua_pop(L, 1);
+            serialise(L, idx, hookWriter);
+        }
+
+        void write_string(int idx) {
+            size_t length;
+            const char* str = lua_tolstring(L, idx, &length);
+            out.write_le(length, 8);
+            out.write(str, length);
+        }
+    public:
+        SnapshotWriter(lua_State* L, const Writer& writer) : L(L), out(writer) {
+            hookWriter = [this](const char* data, size_t size) { out.write(data, size); };
+            lua_newtable(L);
+            seenIdx = lua_gettop(L);
+            lua_pushglobaltable(L);
+            globalsIdx = lua_gettop(L);
+        }
+
+        void write_value(int idx) {
+            idx = lua_absindex(L, idx);
+            if (!lua_checkstack(L, 8))
+                throw Error("snapshot", "Values are nested too deeply");
+            switch (lua_type(L, idx)) {
+                case LUA_TNIL: out.write_le(snapNil, 1); break;
+                case LUA_TBOOLEAN: out.write_le(lua_toboolean(L, idx) ? snapTrue : snapFalse, 1); break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(L, idx)) {
+                        out.write_le(snapInteger, 1);
+                        out.write_le((uint64_t)lua_tointeger(L, idx), 8);
+                    } else {
+                        double number = lua_tonumber(L, idx);
+                        uint64_t bits;
+                        std::memcpy(&bits, &number, sizeof(bits));
+                        out.write_le(snapNumber, 1);
+                        out.write_le(bits, 8);
+                    }
+                    break;
+                case LUA_TSTRING:
+                    out.write_le(snapString, 1);
+                    write_string(idx);
+                    break;
+                case LUA_TTABLE: write_table(idx); break;
+                case LUA_TFUNCTION: write_function(idx); break;
+                case LUA_TUSERDATA: write_object(idx); break;
+                default:
+                    throw Error("snapshot", "Light userdata and threads can't be stored in a snapshot");
+            }
+        }
+
+        void write_root(const std::string& name) {
+            out.write_le(name.size(), 8);
+            out.write(name.data(), name.size());
+            lua_getglobal(L, name.c_str());
+            write_value(-1);
+            lua_pop(L, 1);
+        }
+
+        void write_header(uint32_t rootCount) {
+            out.write(snapshotMagic, sizeof(snapshotMagic) - 1);
+            out.write_le(rootCount, 4);
+        }
+
+        void finish() {
+            out.flush();
+            lua_pop(L, 2); // Pop the seen table and the globals
+        }
+    };
+
+    class SnapshotReader {
+        lua_State* L;
+        const Reader& in;
+        int objectsIdx; // Table of already read objects (id -> object)
+        lua_Integer nextId = 0;
+        int depth = 0;
+
+        uint64_t read_le(int bytes) {
+            char data[8];
+            in(data, bytes);
+            return internal::read_le(data, bytes);
+        }
+
+        std::string read_string() {
+            std::string str;
+            read_in_chunks(in, str, read_le(8));
+            return str;
+        }
+
+        // Reads a value stored in a table or a function
+        void read_nested() {
+            if (++depth > snapshotMaxDepth)
+                throw Error("snapshot", "Values are nested too deeply");
+            read_value();
+            depth--;
+        }
+
+        // Stores the object on top of the stack under the next id
+        void register_object() {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, objectsIdx, nextId++);
+        }
+
+        void read_function() {
+            std::string bytecode = read_string();
+            if (luaL_loadbufferx(L, bytecode.data(), bytecode.size(), "=snapshot", "b") != LUA_OK) {
+                lua_pop(L, 1);
+                throw Error("snapshot", "Invalid function bytecode");
+            }
+            register_object();
+            int funcIdx = lua_gettop(L);
+            int upvalueCount = (int)read_le(1);
+            for (int i = 1; i <= upvalueCount; i++) {
+                if (read_le(1) == 0) {
+                    read_nested();
+                    if (!lua_setupvalue(L, funcIdx, i))
+                        lua_pop(L, 1);
+                    continue;
+                }
+                lua_Integer otherId = read_le(4);
+                int otherUpvalue = (int)read_le(1);
+                if (lua_rawgeti(L, objectsIdx, otherId) != LUA_TFUNCTION)
+                    throw Error("snapshot", "Invalid upvalue reference");
+                lua_upvaluejoin(L, funcIdx, i, -1, otherUpvalue);
+                lua_pop(L, 1);
+            }
+        }
+
+        void read_table() {
+            uint64_t arraySize = read_le(8);
+            uint64_t count = read_le(8);
+            if (arraySize > count)
+                throw Error("snapshot", "Invalid table size");
+            lua_createtable(L, presize_from_data(arraySize), presize_from_data(count - arraySize));
+            register_object();
+            read_nested(); // Metatable
+            if (lua_istable(L, -1))
+                lua_setmetatable(L, -2);
+            else
+                lua_pop(L, 1);
+            for (uint64_t i = 0; i < count; i++) {
+                read_nested();
+                read_nested();
+                if (lua_isnil(L, -2))
+                    throw Error("snapshot", "Invalid table key");
+                lua_rawset(L, -3);
+            }
+        }
+
+        void read_object() {
+            std::string name = read_string();
+            luaL_getmetatable(L, name.c_str());
+            lua_pushliteral(L, "__lua_w_deserialise");
+            if (!lua_istable(L, -2) || lua_rawget(L, -2) != LUA_TLIGHTUSERDATA)
+                throw Error("snapshot", "Type used in the snapshot is not registered or has no serialisation hooks");
+            auto deserialise = (DeserialiseFunc_t)lua_touserdata(L, -1);
+            lua_pop(L, 2);
+            lua_Integer id = nextId++;
+            deserialise(L, in);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, objectsIdx, id);
+        }
+    public:
+        SnapshotReader(lua_State* L, const Reader& reader) : L(L), in(reader) {
+            lua_newtable(L);
+            objectsIdx = lua_gettop(L);
+        }
+
+        // Reads a value and pushes it on to the stack
+        void read_value() {
+            if (!lua_checkstack(L, 8))
+                throw Error("snapshot", "Values are nested too deeply");
+            switch (read_le(1)) {
+                case snapNil: lua_pushnil(L); break;
+                case snapFalse: lua_pushboolean(L, 0); break;
+                case snapTrue: lua_pushboolean(L, 1); break;
+                case snapInteger: lua_pushinteger(L, (lua_Integer)read_le(8)); break;
+                case snapNumber: {
+                    uint64_t bits = read_le(8);
+                    double number;
+                    std::memcpy(&number, &bits, sizeof(number));
+                    lua_pushnumber(L, number);
+                    break;
+                }
+                case snapString: {
+                    std::string str = read_string();
+                    lua_pushlstring(L, str.data(), str.size());
+                    break;
+                }
+                case snapTable: read_table(); break;
+                case snapRef:
+                    if (lua_rawgeti(L, objectsIdx, read_le(4)) == LUA_TNIL)
+                        throw Error("snapshot", "Invalid reference");
+                    break;
+                case snapGlobals: lua_pushglobaltable(L); break;
+                case snapMetatable: luaL_getmetatable(L, read_string().c_str()); break;
+                case snapFunction: read_function(); break;
+                case snapObject: read_object(); break;
+                default: throw Error("snapshot", "Invalid value tag");
+            }
+        }
+
+        uint32_t read_header() {
+            char magic[sizeof(snapshotMagic) - 1];
+            in(magic, sizeof(magic));
+            if (std::memcmp(magic, snapshotMagic, sizeof(magic)) != 0)
+                throw Error("snapshot", "Data is not a lua_w snapshot");
+            return (uint32_t)read_le(4);
+        }
+
+        void read_root() {
+            std::string name = read_string();
+            read_value();
+            lua_setglobal(L, name.c_str());
+        }
+    };
+}
+
+void lua_w::snapshot(lua_State* L, const Writer& writer, const std::vector<std::string>& roots) {
+    int top = lua_gettop(L);
+    try {
+        internal::SnapshotWriter snapshotWriter(L, writer);
+        snapshotWriter.write_header((uint32_t)roots.size());
+        for (const auto& root : roots)
+            snapshotWriter.write_root(root);
+        snapshotWriter.finish();
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+}
+
+void lua_w::restore(lua_State* L, const Reader& reader) {
+    int top = lua_gettop(L);
+    try {
+        internal::SnapshotReader snapshotReader(L, reader);
+        uint32_t rootCount = snapshotReader.read_header();
+        for (uint32_t i = 0; i < rootCount; i++)
+            snapshotReader.read_root();
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+    lua_settop(L, top);
+}
+namespace lua_w::internal {
+    // Functions of the base library that are safe to share with scripts
+    // 'rawset' is left out (it would write to the shared views) and 'getmetatable' is replaced with 'env_getmetatable'
+    static const char* const baseWhitelist[] = {
+        "assert", "error", "ipairs", "next", "pairs", "pcall", "print", "rawequal",
+        "rawget", "rawlen", "select", "setmetatable", "tonumber", "tostring", "type", "xpcall", "_VERSION"
+    };
+
+    static int read_only_newindex(lua_State* L) {
+        return luaL_error(L, "attempt to modify a read-only table");
+    }
+
+    static void make_read_only_view(lua_State* L);
+
+    // Replaces the value on top of the stack with a read-only view if it's a table
+    static void view_if_table(lua_State* L) {
+        if (lua_type(L, -1) == LUA_TTABLE)
+            make_read_only_view(L);
+    }
+
+    // Upvalue 1 of all view metamethods is the viewed table
+    static int read_only_index(lua_State* L) {
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1));
+        view_if_table(L);
+        return 1;
+    }
+
+    static int read_only_next(lua_State* L) {
+        lua_settop(L, 2);
+        if (!lua_next(L, lua_upvalueindex(1))) {
+            lua_pushnil(L);
+            return 1;
+        }
+        view_if_table(L);
+        return 2;
+    }
+
+    static int read_only_pairs(lua_State* L) {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushcclosure(L, &read_only_next, 1);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    static int read_only_len(lua_State* L) {
+        lua_len(L, lua_upvalueindex(1));
+        return 1;
+    }
+
+    // Replaces the table on top of the stack with a read-only view of it. Nested tables are also returned as views
+    // Views are cached (in a table with weak keys), so a table always has the same view
+    static void make_read_only_view(lua_State* L) {
+        if (lua_getfield(L, LUA_REGISTRYINDEX, "LUA_W_READ_ONLY_VIEWS") != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_createtable(L, 0, 1);
+            lua_pushstring(L, "k");
+            lua_setfield(L, -2, "__mode");
+            lua_setmetatable(L, -2);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, LUA_REGISTRYINDEX, "LUA_W_READ_ONLY_VIEWS");
+        }
+        lua_pushvalue(L, -2);
+        if (lua_rawget(L, -2) == LUA_TTABLE) {
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+            return;
+        }
+        lua_pop(L, 1);
+
+        lua_newtable(L); // The view (always empty, so every write goes to '__newindex')
+        lua_createtable(L, 0, 5);
+        lua_pushvalue(L, -4);
+        lua_pushcclosure(L, &read_only_index, 1);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, &read_only_newindex);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushvalue(L, -4);
+        lua_pushcclosure(L, &read_only_pairs, 1);
+        lua_setfield(L, -2, "__pairs");
+        lua_pushvalue(L, -4);
+        lua_pushcclosure(L, &read_only_len, 1);
+        lua_setfield(L, -2, "__len");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+        lua_setmetatable(L, -2);
+
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4); // Cache the view
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+    }
+
+    // 'getmetatable' for environments. Metatables of values other than tables (eg. the string metatable or the ones of registered types)
+    // are shared by the whole state, so only their '__metatable' field is returned
+    static int env_getmetatable(lua_State* L) {
+        luaL_checkany(L, 1);
+        if (luaL_getmetafield(L, 1, "__metatable") != LUA_TNIL)
+            return 1;
+        if (lua_type(L, 1) != LUA_TTABLE || !lua_getmetatable(L, 1))
+            lua_pushnil(L);
+        return 1;
+    }
+
+    // Pushes a metatable that makes environments read missing globals from the environment on top of the stack
+    static void push_environment_metatable(lua_State* L) {
+        lua_createtable(L, 0, 2);
+        lua_pushvalue(L, -2);
+        lua_setfield(L, -2, "__index");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+    }
+}
+
+lua_w::Environment lua_w::Environment::create_base(lua_State* L, uint16_t libs) {
+    // package.loaded, package.preload and the searchers lead to everything in the state (eg. '_G.load', 'os' or 'io')
+    if (libs & Libs::package)
+        throw internal::Error("environment", "The package library can't be shared with sandboxed scripts");
+    Environment env(std::make_shared<internal::LuaObjectReference>(L));
+
+    lua_newtable(L);
+    if (libs & Libs::base) {
+        lua_pushglobaltable(L);
+        for (const char* name : internal::baseWhitelist) {
+            lua_getfield(L, -1, name);
+            lua_setfield(L, -3, name);
+        }
+        lua_pop(L, 1);
+        lua_pushcfunction(L, &internal::env_getmetatable);
+        lua_setfield(L, -2, "getmetatable");
+    }
+    for (const auto& lib : internal::stdLibs) {
+        if (!(libs & lib.flag) || lib.flag == Libs::base)
+            continue;
+        luaL_requiref(L, lib.name, lib.openFunc, 0); // Reuses the library if it's already loaded
+        internal::make_read_only_view(L);
+        lua_setfield(L, -2, lib.name);
+    }
+
+    // The metatable freezes the base and holds the metatable shared by all environments derived form it
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, &internal::read_only_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_pushvalue(L, -2);
+    internal::push_environment_metatable(L);
+    lua_setfield(L, -3, "__lua_w_derived");
+    lua_pop(L, 1);
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, env.envPtr->get_object_id());
+    return env;
+}
+
+lua_w::Environment lua_w::Environment::derive() const {
+    lua_State* L = envPtr->L;
+    Environment env(std::make_shared<internal::LuaObjectReference>(L));
+
+    lua_newtable(L);
+    push_to_stack(L);
+    int top = lua_gettop(L);
+    // Base environments have a shared metatable for derived environments, for other ones a new one is created
+    if (lua_getmetatable(L, -1) && lua_getfield(L, -1, "__lua_w_derived") == LUA_TTABLE)
+        lua_replace(L, top);
+    else {
+        lua_settop(L, top);
+        internal::push_environment_metatable(L);
+        lua_replace(L, top);
+    }
+    lua_settop(L, top);
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, env.envPtr->get_object_id());
+    return env;
+}
+
+lua_w::Function lua_w::load_script(lua_State* L, const char* code, const Environment& env) {
+    if (luaL_loadstring(L, code) != LUA_OK) {
+        internal::Error error("script", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        throw error;
+    }
+    // The first (and only) upvalue of a loaded chunk is it's '_ENV'
+    env.push_to_stack(L);
+    lua_setupvalue(L, -2, 1);
+    auto func = Function::get_form_stack(L, -1);
+    lua_pop(L, 1);
+    return func;
+}
+
+lua_w::Function lua_w::load_script(lua_State* L, const char* code) {
+    if (luaL_loadstring(L, code) != LUA_OK) {
+        internal::Error error("script", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        throw error;
+    }
+    auto func = Function::get_form_stack(L, -1);
+    lua_pop(L, 1);
+    return func;
+}
+namespace lua_w::internal {
+    // Copies values from one state to another
+    static constexpr int transferMaxDepth = 1000; // Nesting of tables (deeper tables would overflow the C stack)
+
+    class Transfer {
+        lua_State* from;
+        lua_State* to;
+        int seenIdx; // Table in the 'to' state: source object address -> copy
+        int depth = 0;
+
+        bool push_seen(int idx) {
+            lua_pushlightuserdata(to, (void*)lua_topointer(from, idx));
+            if (lua_rawget(to, seenIdx) != LUA_TNIL)
+                return true;
+            lua_pop(to, 1);
+            return false;
+        }
+
+        // Marks the value on top of the 'to' stack as the copy of the value at 'idx'
+        void register_copy(int idx) {
+            lua_pushlightuserdata(to, (void*)lua_topointer(from, idx));
+            lua_pushvalue(to, -2);
+            lua_rawset(to, seenIdx);
+        }
+
+        void copy_table(int idx) {
+            if (push_seen(idx))
+                return;
+            if (++depth > transferMaxDepth)
+                throw Error("transfer", "Values are nested too deeply");
+            // Count the entries first, so the copy can be presized
+            lua_Unsigned arraySize = lua_rawlen(from, idx);
+            lua_Unsigned count = 0;
+            lua_pushnil(from);
+            while (lua_next(from, idx) != 0) {
+                lua_pop(from, 1);
+                count++;
+            }
+            lua_createtable(to, (int)arraySize, (int)(count > arraySize ? count - arraySize : 0));
+            register_copy(idx);
+
+            lua_pushnil(from);
+            while (lua_next(from, idx) != 0) {
+                copy(-2);
+                copy(-1);
+                lua_rawset(to, -3);
+                lua_pop(from, 1);
+            }
+            depth--;
+        }
+
+        void copy_userdata(int idx) {
+            if (push_seen(idx))
+                return;
+            if (luaL_getmetafield(from, idx, "__lua_w_copy") != LUA_TLIGHTUSERDATA)
+                throw Error("transfer", "Only registered types that are copy constructible can be transferred");
+            auto copyFunc = (CopyFunc_t)lua_touserdata(from, -1);
+            lua_pop(from, 1);
+
+            luaL_getmetafield(from, idx, "__name");
+            bool isRegistered = luaL_getmetatable(to, lua_tostring(from, -1)) == LUA_TTABLE;
+            lua_pop(from, 1);
+            lua_pop(to, 1);
+            if (!isRegistered)
+                throw Error("transfer", "Transferred type is not registered in the destination state");
+
+            copyFunc(to, lua_touserdata(from, idx));
+            register_copy(idx);
+        }
+    public:
+        Transfer(lua_State* from, lua_State* to) : from(from), to(to) {
+            lua_newtable(to);
+            seenIdx = lua_gettop(to);
+        }
+
+        ~Transfer() {
+            lua_remove(to, seenIdx);
+        }
+
+        // Pushes a copy of the value at 'idx' (in the 'from' state) on to the 'to' stack
+        void copy(int idx) {
+            idx = lua_absindex(from, idx);
+            if (!lua_checkstack(from, 4) || !lua_checkstack(to, 4))
+                throw Error("transfer", "Values are nested too deeply");
+            switch (lua_type(from, idx)) {
+                case LUA_TNIL: lua_pushnil(to); break;
+                case LUA_TBOOLEAN: lua_pushboolean(to, lua_toboolean(from, idx)); break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(from, idx))
+                        lua_pushinteger(to, lua_tointeger(from, idx));
+                    else
+                        lua_pushnumber(to, lua_tonumber(from, idx));
+                    break;
+                case LUA_TSTRING: {
+                    size_t length;
+                    const char* str = lua_tolstring(from, idx, &length);
+                    lua_pushlstring(to, str, length);
+                    break;
+                }
+                case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(to, lua_touserdata(from, idx)); break;
+                case LUA_TTABLE: copy_table(idx); break;
+                case LUA_TUSERDATA: copy_userdata(idx); break;
+                default:
+                    throw Error("transfer", "Functions and threads can't be transferred");
+            }
+        }
+    };
+}
+
+lua_w::Table lua_w::transfer(lua_State* from, int idx, lua_State* to) {
+    if (!lua_istable(from, idx))
+        throw internal::Error("table", "Required value is not a table");
+    int fromTop = lua_gettop(from);
+    int toTop = lua_gettop(to);
+    try {
+        internal::Transfer transfer(from, to);
+        transfer.copy(idx);
+    } catch (...) {
+        lua_settop(from, fromTop);
+        lua_settop(to, toTop);
+        throw;
+    }
+    auto table = Table::get_form_stack(to, -1);
+    lua_pop(to, 1);
+    return table;
+}
+namespace lua_w::internal {
+    // Counts the entries of the table at 'idx' and returns true if the keys are exactly 1..n (empty tables are arrays)
+    static bool is_array(lua_State* L, int idx, lua_Unsigned& count) {
+        count = 0;
+        bool onlyPositiveIntegers = true;
+        lua_Unsigned maxKey = 0;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            lua_pop(L, 1);
+            count++;
+            if (onlyPositiveIntegers) {
+                lua_Integer key = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : 0;
+                if (key < 1)
+                    onlyPositiveIntegers = false;
+                else if ((lua_Unsigned)key > maxKey)
+                    maxKey = (lua_Unsigned)key;
+            }
+        }
+        // Keys are distinct, so 'count' positive integer keys that are all <= 'count' are exactly 1..count
+        return onlyPositiveIntegers && maxKey == count;
+    }
+
+    static constexpr int8_t msgpackObjectExt = 1; // Extension type used for registered types
+    static constexpr int msgpackMaxDepth = 200;
+
+    class MsgpackEncoder {
+        lua_State* L;
+        OutputBuffer out;
+        int depth = 0;
+
+        // Writes the smallest header that fits the size. A 'fixLimit' of 0 means there is no fix variant and a 'tag8' of 0 that there is no 8 bit variant
+        // Tags of the 8, 16 and 32 bit variants are consecutive in the format
+        void write_header(uint64_t size, uint8_t fixTag, uint32_t fixLimit, uint8_t tag8, uint8_t tag16) {
+            if (size < fixLimit)
+                out.write_be(fixTag | size, 1);
+            else if (tag8 != 0 && size <= UINT8_MAX)
+                out.write_be(tag8, 1), out.write_be(size, 1);
+            else if (size <= UINT16_MAX)
+                out.write_be(tag16, 1), out.write_be(size, 2);
+            else if (size <= UINT32_MAX)
+                out.write_be(tag16 + 1, 1), out.write_be(size, 4);
+            else
+                throw Error("msgpack", "Value is too big to be encoded");
+        }
+
+        void write_integer(lua_Integer value) {
+            if (value >= -32 && value <= 127)
+                out.write_be((uint8_t)value, 1);
+            else if (value >= 0) {
+                if (value <= UINT8_MAX) out.write_be(0xcc, 1), out.write_be(value, 1);
+                else if (value <= UINT16_MAX) out.write_be(0xcd, 1), out.write_be(value, 2);
+                else if (value <= UINT32_MAX) out.write_be(0xce, 1), out.write_be(value, 4);
+                else out.write_be(0xcf, 1), out.write_be(value, 8);
+            } else {
+                if (value >= INT8_MIN) out.write_be(0xd0, 1), out.write_be((uint64_t)value, 1);
+                else if (value >= INT16_MIN) out.write_be(0xd1, 1), out.write_be((uint64_t)value, 2);
+                else if (value >= INT32_MIN) out.write_be(0xd2, 1), out.write_be((uint64_t)value, 4);
+                else out.write_be(0xd3, 1), out.write_be((uint64_t)value, 8);
+            }
+        }
+
+        void write_number(double value) {
+            // Floats are used when no precision is lost
+            float single = (float)value;
+            if ((double)single == value) {
+                uint32_t bits;
+                std::memcpy(&bits, &single, sizeof(bits));
+                out.write_be(0xca, 1);
+                out.write_be(bits, 4);
+            } else {
+                uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                out.write_be(0xcb, 1);
+                out.write_be(bits, 8);
+            }
+        }
+
+        void write_string(int idx) {
+            size_t length;
+            const char* str = lua_tolstring(L, idx, &length);
+            write_header(length, 0xa0, 32, 0xd9, 0xda);
+            out.write(str, length);
+        }
+
+        void write_table(int idx) {
+            if (++depth > msgpackMaxDepth)
+                throw Error("msgpack", "Tables are nested too deeply or contain cycles");
+            lua_Unsigned count;
+            if (is_array(L, idx, count)) {
+                write_header(count, 0x90, 16, 0, 0xdc);
+                for (lua_Unsigned i = 1; i <= count; i++) {
+                    lua_rawgeti(L, idx, (lua_Integer)i);
+                    write_value(-1);
+                    lua_pop(L, 1);
+                }
+            } else {
+                write_header(count, 0x80, 16, 0, 0xde);
+                lua_pushnil(L);
+                while (lua_next(L, idx) != 0) {
+                    write_value(-2);
+                    write_value(-1);
+                    lua_pop(L, 1);
+                }
+            }
+            depth--;
+        }
+
+        void write_object(int idx) {
+            if (luaL_getmetafield(L, idx, "__lua_w_serialise") != LUA_TLIGHTUSERDATA)
+                throw Error("msgpack", "Only registered types with serialisation hooks can be encoded");
+            auto serialise = (SerialiseFunc_t)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+
+            // The size of an extension has to be known up front, so the object is serialised in to a temporary buffer
+            luaL_getmetafield(L, idx, "__name");
+            size_t nameLength;
+            const char* name = lua_tolstring(L, -1, &nameLength);
+            if (nameLength > UINT8_MAX) {
+                lua_pop(L, 1);
+                throw Error("msgpack", "Names of encoded types can't be longer than 255 bytes");
+            }
+            std::string payload(1, (char)nameLength);
+            payload.append(name, nameLength);
+            lua_pop(L, 1);
+            serialise(L, idx, [&payload](const char* data, size_t size) { payload.append(data, size); });
+
+            write_header(payload.size(), 0, 0, 0xc7, 0xc8);
+            out.write_be((uint8_t)msgpackObjectExt, 1);
+            out.write(payload.data(), payload.size());
+        }
+    public:
+        MsgpackEncoder(lua_State* L, const Writer& writer) : L(L), out(writer) {}
+
+        void write_value(int idx) {
+            idx = lua_absindex(L, idx);
+            if (!lua_checkstack(L, 4))
+                throw Error("msgpack", "Values are nested too deeply");
+            switch (lua_type(L, idx)) {
+                case LUA_TNIL: out.write_be(0xc0, 1); break;
+                case LUA_TBOOLEAN: out.write_be(lua_toboolean(L, idx) ? 0xc3 : 0xc2, 1); break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(L, idx))
+                        write_integer(lua_tointeger(L, idx));
+                    else
+                        write_number(lua_tonumber(L, idx));
+                    break;
+                case LUA_TSTRING: write_string(idx); break;
+                case LUA_TTABLE: write_table(idx); break;
+                case LUA_TUSERDATA: write_object(idx); break;
+                default:
+                    throw Error("msgpack", "Functions, threads and light userdata can't be encoded");
+            }
+        }
+
+        void finish() {
+            out.flush();
+        }
+    };
+
+    class MsgpackDecoder {
+        lua_State* L;
+        const Reader& in;
+        int depth = 0;
+
+        uint64_t read_be(int bytes) {
+            char data[8];
+            in(data, bytes);
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; i++)
+                value = (value << 8) | (uint8_t)data[i];
+            return value;
+        }
+
+        void read_string(uint64_t length) {
+            // Short strings are read in place, longer ones through a buffer
+            char small[64];
+            if (length <= sizeof(small)) {
+                in(small, length);
+                lua_pushlstring(L, small, length);
+                return;
+            }
+            std::string str;
+            read_in_chunks(in, str, length);
+            lua_pushlstring(L, str.data(), length);
+        }
+
+        void read_array(uint64_t count) {
+            if (++depth > msgpackMaxDepth)
+                throw Error("msgpack", "Values are nested too deeply");
+            lua_createtable(L, presize_from_data(count), 0);
+            for (uint64_t i = 1; i <= count; i++) {
+                read_value();
+                lua_rawseti(L, -2, (lua_Integer)i);
+            }
+            depth--;
+        }
+
+        void read_map(uint64_t count) {
+            if (++depth > msgpackMaxDepth)
+                throw Error("msgpack", "Values are nested too deeply");
+            lua_createtable(L, 0, presize_from_data(count));
+            for (uint64_t i = 0; i < count; i++) {
+                read_value();
+                if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+                    throw Error("msgpack", "Invalid map key");
+                read_value();
+                lua_rawset(L, -3);
+            }
+            depth--;
+        }
+
+        void read_ext(uint64_t size) {
+            int8_t type = (int8_t)read_be(1);
+            std::string payload;
+            read_in_chunks(in, payload, size);
+            if (type != msgpackObjectExt || size == 0 || (uint8_t)payload[0] + 1u > size)
+                throw Error("msgpack", "Unsupported extension type");
+
+            std::string name = payload.substr(1, (uint8_t)payload[0]);
+            luaL_getmetatable(L, name.c_str());
+            lua_pushliteral(L, "__lua_w_deserialise");
+            if (!lua_istable(L, -2) || lua_rawget(L, -2) != LUA_TLIGHTUSERDATA)
+                throw Error("msgpack", "Encoded type is not registered or has no serialisation hooks");
+            auto deserialise = (DeserialiseFunc_t)lua_touserdata(L, -1);
+            lua_pop(L, 2);
+
+            size_t readPos = name.size() + 1;
+            deserialise(L, [&payload, &readPos](char* data, size_t size) {
+                if (payload.size() - readPos < size)
+                    throw Error("msgpack", "Extension data is too short");
+                std::memcpy(data, payload.data() + readPos, size);
+                readPos += size;
+            });
+        }
+    public:
+        MsgpackDecoder(lua_State* L, const Reader& reader) : L(L), in(reader) {}
+
+        // Reads a value and pushes it on to the stack
+        void read_value() {
+            if (!lua_checkstack(L, 4))
+                throw Error("msgpack", "Values are nested too deeply");
+            uint8_t tag = (uint8_t)read_be(1);
+            if (tag <= 0x7f) { lua_pushinteger(L, tag); return; }
+            if (tag >= 0xe0) { lua_pushinteger(L, (int8_t)tag); return; }
+            if ((tag & 0xf0) == 0x80) { read_map(tag & 0x0f); return; }
+            if ((tag & 0xf0) == 0x90) { read_array(tag & 0x0f); return; }
+            if ((tag & 0xe0) == 0xa0) { read_string(tag & 0x1f); return; }
+            switch (tag) {
+                case 0xc0: lua_pushnil(L); break;
+                case 0xc2: lua_pushboolean(L, 0); break;
+                case 0xc3: lua_pushboolean(L, 1); break;
+                case 0xc4: case 0xd9: read_string(read_be(1)); break;
+                case 0xc5: case 0xda: read_string(read_be(2)); break;
+                case 0xc6: case 0xdb: read_string(read_be(4)); break;
+                case 0xc7: read_ext(read_be(1)); break;
+                case 0xc8: read_ext(read_be(2)); break;
+                case 0xc9: read_ext(read_be(4)); break;
+                case 0xca: {
+                    uint32_t bits = (uint32_t)read_be(4);
+                    float number;
+                    std::memcpy(&number, &bits, sizeof(number));
+                    lua_pushnumber(L, number);
+                    break;
+                }
+                case 0xcb: {
+                    uint64_t bits = read_be(8);
+                    double number;
+                    std::memcpy(&number, &bits, sizeof(number));
+                    lua_pushnumber(L, number);
+                    break;
+                }
+                case 0xcc: lua_pushinteger(L, (lua_Integer)read_be(1)); break;
+                case 0xcd: lua_pushinteger(L, (lua_Integer)read_be(2)); break;
+                case 0xce: lua_pushinteger(L, (lua_Integer)read_be(4)); break;
+                case 0xcf: lua_pushinteger(L, (lua_Integer)read_be(8)); break; // Values above INT64_MAX wrap around like in Lua
+                case 0xd0: lua_pushinteger(L, (int8_t)read_be(1)); break;
+                case 0xd1: lua_pushinteger(L, (int16_t)read_be(2)); break;
+                case 0xd2: lua_pushinteger(L, (int32_t)read_be(4)); break;
+                case 0xd3: lua_pushinteger(L, (lua_Integer)read_be(8)); break;
+                case 0xd4: read_ext(1); break;
+                case 0xd5: read_ext(2); break;
+                case 0xd6: read_ext(4); break;
+                case 0xd7: read_ext(8); break;
+                case 0xd8: read_ext(16); break;
+                case 0xdc: read_array(read_be(2)); break;
+                case 0xdd: read_array(read_be(4)); break;
+                case 0xde: read_map(read_be(2)); break;
+                case 0xdf: read_map(read_be(4)); break;
+                default: throw Error("msgpack", "Invalid type tag");
+            }
+        }
+    };
+
+    static int msgpack_encode(lua_State* L) {
+        luaL_checkany(L, 1);
+        bool failed = false;
+        {
+            std::string data;
+            try {
+                Writer writer = [&data](const char* ptr, size_t size) { data.append(ptr, size); };
+                MsgpackEncoder encoder(L, writer);
+                encoder.write_value(1);
+                encoder.finish();
+                lua_pushlstring(L, data.data(), data.size());
+            } catch (const Error& e) {
+                lua_pushstring(L, e.what());
+                failed = true;
+            }
+        }
+        // Raised outside of the block, so the buffer is freed before the long jump
+        if (failed)
+            return lua_error(L);
+        return 1;
+    }
+
+    static int msgpack_decode(lua_State* L) {
+        size_t size;
+        const char* data = luaL_checklstring(L, 1, &size);
+        int top = lua_gettop(L);
+        bool failed = false;
+        try {
+            size_t readPos = 0;
+            Reader reader = [data, size, &readPos](char* ptr, size_t count) {
+                if (size - readPos < count)
+                    throw Error("msgpack", "Unexpected end of data");
+                std::memcpy(ptr, data + readPos, count);
+                readPos += count;
+            };
+            MsgpackDecoder decoder(L, reader);
+            decoder.read_value();
+        } catch (const Error& e) {
+            lua_settop(L, top);
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        if (failed)
+            return lua_error(L);
+        return 1;
+    }
+}
+
+void lua_w::encode(lua_State* L, int idx, const Writer& writer) {
+    int top = lua_gettop(L);
+    try {
+        internal::MsgpackEncoder encoder(L, writer);
+        encoder.write_value(idx);
+        encoder.finish();
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+}
+
+void lua_w::decode(lua_State* L, const Reader& reader) {
+    int top = lua_gettop(L);
+    try {
+        internal::MsgpackDecoder decoder(L, reader);
+        decoder.read_value();
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+}
+
+void lua_w::register_msgpack_functions(lua_State* L) noexcept {
+    static const luaL_Reg functions[] = {
+        { "encode", &internal::msgpack_encode },
+        { "decode", &internal::msgpack_decode },
+        { nullptr, nullptr }
+    };
+    luaL_newlib(L, functions);
+    lua_setglobal(L, "msgpack");
+}
+namespace lua_w::internal {
+    static constexpr int jsonMaxDepth = 200;
+
+    class JsonParser {
+        lua_State* L;
+        const char* begin;
+        const char* pos;
+        const char* end;
+        std::vector<uint32_t> sizes; // Element counts of all containers in the order of their opening brackets
+        size_t nextContainer = 0;
+        std::string unescaped; // Reused for strings with escapes
+        int depth = 0;
+
+        // Recently used object keys. Keys repeat a lot in JSON (arrays of objects), so a hit skips hashing the key in to the Lua string table
+        struct CachedKey {
+            const char* str = nullptr;
+            size_t length = 0;
+        };
+        CachedKey keyCache[256];
+        int keyCacheIdx; // Lua table with the cached strings (slot + 1 -> string)
+
+        [[noreturn]] void fail(const char* message) {
+            std::string error = std::string(message) + " at position " + std::to_string(pos - begin);
+            throw Error("json", error.c_str());
+        }
+
+        void skip_whitespace() {
+            while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+                pos++;
+        }
+
+        // First pass: counts elements of every container, so tables can be created with the right size
+        // The JSON isn't validated here, the second pass does that
+        void count_elements() {
+            std::vector<size_t> open;
+            bool awaitingFirst = false;
+            for (const char* it = pos; it < end; it++) {
+                char c = *it;
+                if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+                    continue;
+                if (awaitingFirst) {
+                    awaitingFirst = false;
+                    if (c != ']' && c != '}')
+                        sizes[open.back()] = 1;
+                }
+                switch (c) {
+                    case '"':
+                        for (it++; it < end && *it != '"'; it++) {
+                            if (*it == '\\')
+                                it++;
+                        }
+                        break;
+                    case '[': case '{':
+                        open.push_back(sizes.size());
+                        sizes.push_back(0);
+                        awaitingFirst = true;
+                        break;
+                    case ']': case '}':
+                        if (!open.empty())
+                            open.pop_back();
+                        break;
+                    case ',':
+                        if (!open.empty())
+                            sizes[open.back()]++;
+                        break;
+                }
+            }
+        }
+
+        int next_size() {
+            uint32_t size = nextContainer < sizes.size() ? sizes[nextContainer] : 0;
+            nextContainer++;
+            return (int)size;
+        }
+
+        static void append_utf8(std::string& str, uint32_t code) {
+            if (code < 0x80)
+                str += (char)code;
+            else if (code < 0x800) {
+                str += (char)(0xc0 | (code >> 6));
+                str += (char)(0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                str += (char)(0xe0 | (code >> 12));
+                str += (char)(0x80 | ((code >> 6) & 0x3f));
+                str += (char)(0x80 | (code & 0x3f));
+            } else {
+                str += (char)(0xf0 | (code >> 18));
+                str += (char)(0x80 | ((code >> 12) & 0x3f));
+                str += (char)(0x80 | ((code >> 6) & 0x3f));
+                str += (char)(0x80 | (code & 0x3f));
+            }
+        }
+
+        uint32_t read_hex4() {
+            if (end - pos < 4)
+                fail("Invalid unicode escape");
+            uint32_t code = 0;
+            for (int i = 0; i < 4; i++, pos++) {
+                char c = *pos;
+                code <<= 4;
+                if (c >= '0' && c <= '9') code |= c - '0';
+                else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+                else fail("Invalid unicode escape");
+            }
+            return code;
+        }
+
+        // Parses a string (pos is after the opening quote). Returns false when the string has escapes (the result is then in 'unescaped')
+        bool read_string(const char*& str, size_t& length) {
+            const char* start = pos;
+            while (pos < end && *pos != '"' && *pos != '\\') {
+                if ((unsigned char)*pos < 0x20)
+                    fail("Control character in a string");
+                pos++;
+            }
+            if (pos >= end)
+                fail("Unterminated string");
+            if (*pos == '"') {
+                str = start;
+                length = pos - start;
+                pos++;
+                return true;
+            }
+
+            unescaped.assign(start, pos - start);
+            while (true) {
+                if (pos >= end)
+                    fail("Unterminated string");
+                char c = *pos++;
+                if (c == '"')
+                    break;
+                if ((unsigned char)c < 0x20)
+                    fail("Control character in a string");
+                if (c != '\\') {
+                    unescaped += c;
+                    continue;
+                }
+                if (pos >= end)
+                    fail("Unterminated string");
+                switch (*pos++) {
+                    case '"': unescaped += '"'; break;
+                    case '\\': unescaped += '\\'; break;
+                    case '/': unescaped += '/'; break;
+                    case 'b': unescaped += '\b'; break;
+                    case 'f': unescaped += '\f'; break;
+                    case 'n': unescaped += '\n'; break;
+                    case 'r': unescaped += '\r'; break;
+                    case 't': unescaped += '\t'; break;
+                    case 'u': {
+                        uint32_t code = read_hex4();
+                        // Surrogate pairs are joined in to one code point
+                        if (code >= 0xd800 && code <= 0xdbff && end - pos >= 6 && pos[0] == '\\' && pos[1] == 'u') {
+                            pos += 2;
+                            uint32_t low = read_hex4();
+                            if (low < 0xdc00 || low > 0xdfff)
+                                fail("Invalid surrogate pair");
+                            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        }
+                        append_utf8(unescaped, code);
+                        break;
+                    }
+                    default: fail("Invalid escape sequence");
+                }
+            }
+            str = unescaped.data();
+            length = unescaped.size();
+            return false;
+        }
+
+        void push_key() {
+            const char* str;
+            size_t length;
+            if (!read_string(str, length)) {
+                lua_pushlstring(L, str, length);
+                return;
+            }
+            size_t slot = (length * 31 + (length > 0 ? (unsigned char)str[0] * 7 + (unsigned char)str[length - 1] : 0)) & 255;
+            CachedKey& cached = keyCache[slot];
+            if (cached.length == length && cached.str && std::memcmp(cached.str, str, length) == 0) {
+                lua_rawgeti(L, keyCacheIdx, (lua_Integer)slot + 1);
+                return;
+            }
+            lua_pushlstring(L, str, length);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, keyCacheIdx, (lua_Integer)slot + 1);
+            cached.str = str; // Points in to the source, which outlives the parser
+            cached.length = length;
+        }
+
+        void read_number() {
+            const char* start = pos;
+            if (pos < end && *pos == '-')
+                pos++;
+            if (pos >= end || *pos < '0' || *pos > '9')
+                fail("Invalid value");
+            if (*pos == '0')
+                pos++;
+            else {
+                while (pos < end && *pos >= '0' && *pos <= '9')
+                    pos++;
+            }
+            if (pos < end && *pos == '.') {
+                pos++;
+                if (pos >= end || *pos < '0' || *pos > '9')
+                    fail("Invalid number");
+                while (pos < end && *pos >= '0' && *pos <= '9')
+                    pos++;
+            }
+            if (pos < end && (*pos == 'e' || *pos == 'E')) {
+                pos++;
+                if (pos < end && (*pos == '+' || *pos == '-'))
+                    pos++;
+                if (pos >= end || *pos < '0' || *pos > '9')
+                    fail("Invalid number");
+                while (pos < end && *pos >= '0' && *pos <= '9')
+                    pos++;
+            }
+
+            // Lua's conversion keeps integers as integers (and turns the ones that overflow in to floats)
+            char small[64];
+            size_t length = pos - start;
+            size_t converted;
+            if (length < sizeof(small)) {
+                std::memcpy(small, start, length);
+                small[length] = '\0';
+                converted = lua_stringtonumber(L, small);
+            } else {
+                std::string number(start, length);
+                converted = lua_stringtonumber(L, number.c_str());
+            }
+            if (converted == 0) // Nothing was pushed
+                fail("Invalid number");
+        }
+
+        void read_literal(const char* literal, size_t length) {
+            if ((size_t)(end - pos) < length || std::memcmp(pos, literal, length) != 0)
+                fail("Invalid value");
+            pos += length;
+        }
+
+        void read_array() {
+            lua_createtable(L, next_size(), 0);
+            skip_whitespace();
+            if (pos < end && *pos == ']') {
+                pos++;
+                return;
+            }
+            for (lua_Integer i = 1;; i++) {
+                read_value();
+                lua_rawseti(L, -2, i);
+                skip_whitespace();
+                if (pos < end && *pos == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < end && *pos == ']') {
+                    pos++;
+                    return;
+                }
+                fail("Expected ',' or ']'");
+            }
+        }
+
+        void read_object() {
+            lua_createtable(L, 0, next_size());
+            skip_whitespace();
+            if (pos < end && *pos == '}') {
+                pos++;
+                return;
+            }
+            while (true) {
+                skip_whitespace();
+                if (pos >= end || *pos != '"')
+                    fail("Expected a string key");
+                pos++;
+                push_key();
+                skip_whitespace();
+                if (pos >= end || *pos != ':')
+                    fail("Expected ':'");
+                pos++;
+                read_value();
+                lua_rawset(L, -3);
+                skip_whitespace();
+                if (pos < end && *pos == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < end && *pos == '}') {
+                    pos++;
+                    return;
+                }
+                fail("Expected ',' or '}'");
+            }
+        }
+
+        void read_value() {
+            if (!lua_checkstack(L, 4) || depth > jsonMaxDepth)
+                fail("Values are nested too deeply");
+            skip_whitespace();
+            if (pos >= end)
+                fail("Unexpected end of data");
+            switch (*pos) {
+                case '{': pos++; depth++; read_object(); depth--; break;
+                case '[': pos++; depth++; read_array(); depth--; break;
+                case '"': {
+                    pos++;
+                    const char* str;
+                    size_t length;
+                    read_string(str, length);
+                    lua_pushlstring(L, str, length);
+                    break;
+                }
+                case 't': read_literal("true", 4); lua_pushboolean(L, 1); break;
+                case 'f': read_literal("false", 5); lua_pushboolean(L, 0); break;
+                case 'n': read_literal("null", 4); lua_pushnil(L); break;
+                default: read_number(); break;
+            }
+        }
+    public:
+        JsonParser(lua_State* L, std::string_view json) : L(L), begin(json.data()), pos(json.data()), end(json.data() + json.size()) {}
+
+        // Parses the whole input and pushes the value on to the stack
+        void parse() {
+            count_elements();
+            lua_createtable(L, 256, 0);
+            keyCacheIdx = lua_gettop(L);
+            read_value();
+            skip_whitespace();
+            if (pos != end)
+                fail("Unexpected data after the value");
+            lua_remove(L, keyCacheIdx);
+        }
+    };
+
+    static int json_encode(lua_State* L) {
+        luaL_checkany(L, 1);
+        auto encoder = (JsonEncoder*)lua_touserdata(L, lua_upvalueindex(1));
+        bool failed = false;
+        try {
+            std::string_view json = encoder->encode(L, 1);
+            lua_pushlstring(L, json.data(), json.size());
+        } catch (const Error& e) {
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        if (failed)
+            return lua_error(L);
+        return 1;
+    }
+
+    static int json_decode(lua_State* L) {
+        size_t size;
+        const char* data = luaL_checklstring(L, 1, &size);
+        int top = lua_gettop(L);
+        bool failed = false;
+        try {
+            JsonParser parser(L, std::string_view(data, size));
+            parser.parse();
+        } catch (const Error& e) {
+            lua_settop(L, top);
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        // Raised outside of the block, so the parser's buffers are freed before the long jump
+        if (failed)
+            return lua_error(L);
+        return 1;
+    }
+}
+
+void lua_w::push_json(lua_State* L, std::string_view json) {
+    int top = lua_gettop(L);
+    try {
+        internal::JsonParser parser(L, json);
+        parser.parse();
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+}
+
+lua_w::Table lua_w::from_json(lua_State* L, std::string_view json) {
+    push_json(L, json);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        throw internal::Error("json", "JSON value is not an object or an array");
+    }
+    auto table = Table::get_form_stack(L, -1);
+    lua_pop(L, 1);
+    return table;
+}
+
+std::string_view lua_w::JsonEncoder::encode(lua_State* L, int idx) {
+    buffer.clear();
+    depth = 0;
+    int top = lua_gettop(L);
+    try {
+        write_value(L, lua_absindex(L, idx));
+    } catch (...) {
+        lua_settop(L, top);
+        throw;
+    }
+    return buffer;
+}
+
+void lua_w::JsonEncoder::write_value(lua_State* L, int idx) {
+    if (!lua_checkstack(L, 4))
+        throw internal::Error("json", "Values are nested too deeply");
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL: buffer += "null"; break;
+        case LUA_TBOOLEAN: buffer += lua_toboolean(L, idx) ? "true" : "false"; break;
+        case LUA_TNUMBER: {
+            char number[32];
+            if (lua_isinteger(L, idx)) {
+                buffer.append(number, std::snprintf(number, sizeof(number), LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger(L, idx)));
+                break;
+            }
+            double value = lua_tonumber(L, idx);
+            if (value != value || value - value != 0)
+                throw internal::Error("json", "NaN and infinity can't be encoded");
+            // The shortest precision that reads back as the same number (17 digits always do)
+            // Both printf and strtod use the decimal point of the locale, so they agree with each other. JSON always uses '.'
+            int length = 0;
+            for (const char* format : { "%.15g", "%.16g", "%.17g" }) {
+                length = std::snprintf(number, sizeof(number), format, value);
+                if (std::strtod(number, nullptr) == value)
+                    break;
+            }
+            if (char* point = std::strchr(number, std::localeconv()->decimal_point[0]))
+                *point = '.';
+            buffer.append(number, length);
+            // Whole floats get a fraction, so they are decoded as floats again
+            if (std::strpbrk(number, ".e") == nullptr)
+                buffer += ".0";
+            break;
+        }
+        case LUA_TSTRING: {
+            size_t length;
+            const char* str = lua_tolstring(L, idx, &length);
+            write_string(str, length);
+            break;
+        }
+        case LUA_TTABLE: write_table(L, idx); break;
+        default:
+            throw internal::Error("json", "Only nil, booleans, numbers, strings and tables can be encoded");
+    }
+}
+
+void lua_w::JsonEncoder::write_string(const char* str, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    buffer += '"';
+    const char* plainStart = str;
+    for (const char* it = str; it < str + length; it++) {
+        unsigned char c = (unsigned char)*it;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        buffer.append(plainStart, it - plainStart);
+        plainStart = it + 1;
+        switch (c) {
+            case '"': buffer += "\\\""; break;
+            case '\\': buffer += "\\\\"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\t': buffer += "\\t"; break;
+            case '\b': buffer += "\\b"; break;
+            case '\f': buffer += "\\f"; break;
+            default:
+                buffer += "\\u00";
+                buffer += hex[c >> 4];
+                buffer += hex[c & 0xf];
+        }
+    }
+    buffer.append(plainStart, str + length - plainStart);
+    buffer += '"';
+}
+
+void lua_w::JsonEncoder::write_table(lua_State* L, int idx) {
+    if (++depth > internal::jsonMaxDepth)
+        throw internal::Error("json", "Tables are nested too deeply or contain cycles");
+    lua_Unsigned count;
+    if (internal::is_array(L, idx, count)) {
+        buffer += '[';
+        for (lua_Unsigned i = 1; i <= count; i++) {
+            if (i > 1)
+                buffer += ',';
+            lua_rawgeti(L, idx, (lua_Integer)i);
+            write_value(L, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        buffer += ']';
+    } else {
+        buffer += '{';
+        bool first = true;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            if (!first)
+                buffer += ',';
+            first = false;
+            size_t length;
+            const char* key;
+            switch (lua_type(L, -2)) {
+                case LUA_TSTRING:
+                    key = lua_tolstring(L, -2, &length);
+                    write_string(key, length);
+                    break;
+                case LUA_TNUMBER:
+                    // Converted on a copy, so lua_next still gets the original key
+                    lua_pushvalue(L, -2);
+                    key = lua_tolstring(L, -1, &length);
+                    write_string(key, length);
+                    lua_pop(L, 1);
+                    break;
+                default:
+                    throw internal::Error("json", "Only string and number keys can be encoded");
+            }
+            buffer += ':';
+            write_value(L, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        buffer += '}';
+    }
+    depth--;
+}
+
+void lua_w::register_json_functions(lua_State* L) noexcept {
+    lua_createtable(L, 0, 2);
+    // The encoder (and it's buffer) lives as long as the function that uses it
+    new (lua_newuserdatauv(L, sizeof(JsonEncoder), 0)) JsonEncoder();
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, [](lua_State* L) -> int {
+        ((JsonEncoder*)lua_touserdata(L, 1))->~JsonEncoder();
+        return 0;
+    });
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, &internal::json_encode, 1);
+    lua_setfield(L, -2, "encode");
+    lua_pushcfunction(L, &internal::json_decode);
+    lua_setfield(L, -2, "decode");
+    lua_setglobal(L, "json");
+}
+namespace lua_w::internal {
+    using ChangedKeys_t = std::unordered_set<std::string>;
+    using ChangedKeysPtr_t = std::shared_ptr<ChangedKeys_t>;
+
+    // __newindex of observed tables. Upvalues: storage table, userdata with the changed keys
+    static int observed_newindex(lua_State* L) {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        bool same = lua_rawequal(L, -1, 3);
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+        lua_rawset(L, lua_upvalueindex(1));
+        if (same)
+            return 0;
+
+        int keyType = lua_type(L, 2);
+        if (keyType != LUA_TSTRING && keyType != LUA_TNUMBER)
+            return 0;
+        lua_pushvalue(L, 2); // Numbers are converted on a copy
+        size_t length;
+        const char* key = lua_tolstring(L, -1, &length);
+        ChangedKeys_t* changed = ((ChangedKeysPtr_t*)lua_touserdata(L, lua_upvalueindex(2)))->get();
+        try {
+            changed->emplace(key, length);
+        } catch (const std::bad_alloc&) {
+            return luaL_error(L, "not enough memory");
+        }
+        return 0;
+    }
+
+    static int observed_len(lua_State* L) {
+        lua_pushinteger(L, (lua_Integer)lua_rawlen(L, lua_upvalueindex(1)));
+        return 1;
+    }
+
+    static int observed_next(lua_State* L) {
+        lua_settop(L, 2);
+        if (lua_next(L, 1))
+            return 2;
+        lua_pushnil(L);
+        return 1;
+    }
+
+    static int observed_pairs(lua_State* L) {
+        lua_pushcfunction(L, &observed_next);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushnil(L);
+        return 3;
+    }
+}
+
+lua_w::ObservedTable::ObservedTable(lua_State* L) :
+    proxyPtr(std::make_shared<internal::LuaObjectReference>(L)), changed(std::make_shared<internal::ChangedKeys_t>()) {
+    lua_createtable(L, 2, 0); // Registry slot
+    lua_newtable(L); // Proxy
+    lua_createtable(L, 0, 5); // Metatable
+    lua_newtable(L); // Storage
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "__index");
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -5, 2);
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -3, "__metatable");
+
+    lua_pushvalue(L, -1);
+    new (lua_newuserdatauv(L, sizeof(internal::ChangedKeysPtr_t), 0)) internal::ChangedKeysPtr_t(changed);
+    if (luaL_newmetatable(L, "LUA_W_OBSERVED")) {
+        lua_pushcfunction(L, [](lua_State* L) -> int {
+            ((internal::ChangedKeysPtr_t*)lua_touserdata(L, 1))->~shared_ptr();
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, &internal::observed_newindex, 2);
+    lua_setfield(L, -3, "__newindex");
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, &internal::observed_len, 1);
+    lua_setfield(L, -3, "__len");
+    lua_pushcclosure(L, &internal::observed_pairs, 1);
+    lua_setfield(L, -2, "__pairs");
+
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, proxyPtr->get_object_id());
+}
+
+lua_w::Table lua_w::ObservedTable::storage() const noexcept {
+    lua_State* L = proxyPtr->L;
+    push_storage(L);
+    auto table = Table::get_form_stack(L, -1);
+    lua_pop(L, 1);
+    return table;
+}
+
+std::vector<std::string> lua_w::ObservedTable::drain_changes() {
+    std::vector<std::string> keys;
+    keys.reserve(changed->size());
+    for (auto it = changed->begin(); it != changed->end();)
+        keys.push_back(std::move(changed->extract(it++).value()));
+    return keys;
+}
+lua_w::TableCursor::TableCursor(lua_State* L, const Table& table) : statePtr(std::make_shared<internal::LuaObjectReference>(L)) {
+    lua_createtable(L, 2, 0);
+    table.push_to_stack(L);
+    lua_rawseti(L, -2, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, statePtr->get_object_id());
+}
+
+void lua_w::TableCursor::reset() noexcept {
+    lua_State* L = statePtr->L;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, statePtr->get_object_id());
+    lua_pushnil(L);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 1);
+    done = false;
+}
+namespace lua_w::internal {
+    // Element of an array that mixes integers and floats. It keeps the integer, so it can be written back unchanged
+    struct MixedNumber {
+        lua_Number value;
+        lua_Integer integer;
+        bool isInteger;
+    };
+
+    static inline void push_number(lua_State* L, lua_Integer value) { lua_pushinteger(L, value); }
+    static inline void push_number(lua_State* L, const MixedNumber& value) {
+        if (value.isInteger)
+            lua_pushinteger(L, value.integer);
+        else
+            lua_pushnumber(L, value.value);
+    }
+
+    // Integers and floats are compared exactly (like in Lua), converting the integer could round it.
+    // Floats in [-2^63, 2^63) are rounded towards the integer and compared as integers, the rest are out of range
+    static inline bool integer_less_float(lua_Integer lhs, lua_Number rhs) {
+        if (rhs != rhs)
+            return true; // NaNs are the largest
+        if (rhs >= -(lua_Number)LUA_MININTEGER)
+            return true;
+        if (rhs < (lua_Number)LUA_MININTEGER)
+            return false;
+        return lhs < (lua_Integer)std::ceil(rhs);
+    }
+    static inline bool float_less_integer(lua_Number lhs, lua_Integer rhs) {
+        if (lhs != lhs || lhs >= -(lua_Number)LUA_MININTEGER)
+            return false;
+        if (lhs < (lua_Number)LUA_MININTEGER)
+            return true;
+        return (lua_Integer)std::floor(lhs) < rhs;
+    }
+
+    static inline bool number_less(lua_Integer lhs, lua_Integer rhs) { return lhs < rhs; }
+    static inline bool number_less(const MixedNumber& lhs, const MixedNumber& rhs) {
+        if (lhs.isInteger && rhs.isInteger)
+            return lhs.integer < rhs.integer;
+        if (lhs.isInteger)
+            return integer_less_float(lhs.integer, rhs.value);
+        if (rhs.isInteger)
+            return float_less_integer(lhs.value, rhs.integer);
+        return lhs.value < rhs.value || (rhs.value != rhs.value && lhs.value == lhs.value); // NaNs are the largest
+    }
+
+    static inline bool number_equal(lua_Integer lhs, lua_Integer rhs) { return lhs == rhs; }
+    static inline bool number_equal(const MixedNumber& lhs, const MixedNumber& rhs) {
+        if (lhs.isInteger && rhs.isInteger)
+            return lhs.integer == rhs.integer;
+        if (lhs.isInteger != rhs.isInteger) {
+            const MixedNumber& integer = lhs.isInteger ? lhs : rhs;
+            lua_Number value = lhs.isInteger ? rhs.value : lhs.value;
+            return !integer_less_float(integer.integer, value) && !float_less_integer(value, integer.integer);
+        }
+        return lhs.value == rhs.value;
+    }
+
+    static inline lua_Number to_number(lua_Integer value) { return (lua_Number)value; }
+    static inline lua_Number to_number(const MixedNumber& value) { return value.value; }
+
+    // Loads the array part in to the smallest fitting buffer and calls the function with it
+    template<class Function>
+    static void with_numeric_array(lua_State* L, int idx, const Function& function) {
+        lua_Unsigned length = lua_rawlen(L, idx);
+        std::vector<lua_Integer> integers;
+        integers.reserve(length);
+        lua_Unsigned i = 1;
+        for (; i <= length; i++) {
+            if (lua_rawgeti(L, idx, (lua_Integer)i) != LUA_TNUMBER || !lua_isinteger(L, -1))
+                break;
+            integers.push_back(lua_tointeger(L, -1));
+            lua_pop(L, 1);
+        }
+        if (i > length) {
+            function(integers);
+            return;
+        }
+        lua_pop(L, 1);
+
+        // A float (or not a number) was found, so the loaded integers are moved to the mixed buffer
+        std::vector<MixedNumber> numbers;
+        numbers.reserve(length);
+        for (lua_Integer value : integers)
+            numbers.push_back({ (lua_Number)value, value, true });
+        integers = std::vector<lua_Integer>();
+        for (; i <= length; i++) {
+            if (lua_rawgeti(L, idx, (lua_Integer)i) != LUA_TNUMBER) {
+                lua_pop(L, 1);
+                throw Error("number", "Array contains a value that is not a number");
+            }
+            if (lua_isinteger(L, -1))
+                numbers.push_back({ (lua_Number)lua_tointeger(L, -1), lua_tointeger(L, -1), true });
+            else
+                numbers.push_back({ lua_tonumber(L, -1), 0, false });
+            lua_pop(L, 1);
+        }
+        function(numbers);
+    }
+
+    template<class TNumber>
+    static void write_numeric_array(lua_State* L, int idx, const std::vector<TNumber>& values) {
+        for (size_t i = 0; i < values.size(); i++) {
+            push_number(L, values[i]);
+            lua_rawseti(L, idx, (lua_Integer)i + 1);
+        }
+    }
+
+    static void sort_array(lua_State* L, int idx, bool descending) {
+        with_numeric_array(L, idx, [L, idx, descending](auto& values) {
+            using number_t = typename std::decay_t<decltype(values)>::value_type;
+            if (descending) // NaNs still go to the end
+                std::sort(values.begin(), values.end(), [](const number_t& lhs, const number_t& rhs) {
+                    bool lhsNan = to_number(lhs) != to_number(lhs);
+                    bool rhsNan = to_number(rhs) != to_number(rhs);
+                    if (lhsNan || rhsNan)
+                        return !lhsNan;
+                    return number_less(rhs, lhs);
+                });
+            else
+                std::sort(values.begin(), values.end(), [](const number_t& lhs, const number_t& rhs) { return number_less(lhs, rhs); });
+            write_numeric_array(L, idx, values);
+        });
+    }
+
+    // Pushes the sum (an integer if all values are integers)
+    static void sum_array(lua_State* L, int idx) {
+        with_numeric_array(L, idx, [L](auto& values) {
+            using number_t = typename std::decay_t<decltype(values)>::value_type;
+            if constexpr (std::is_same_v<number_t, lua_Integer>) {
+                lua_Unsigned sum = 0; // Wraps around like in Lua
+                for (lua_Integer value : values)
+                    sum += (lua_Unsigned)value;
+                lua_pushinteger(L, (lua_Integer)sum);
+            } else {
+                // Independent accumulators let the additions run in parallel
+                lua_Number partial[4] = { 0, 0, 0, 0 };
+                size_t i = 0;
+                for (; i + 4 <= values.size(); i += 4) {
+                    partial[0] += values[i].value;
+                    partial[1] += values[i + 1].value;
+                    partial[2] += values[i + 2].value;
+                    partial[3] += values[i + 3].value;
+                }
+                for (; i < values.size(); i++)
+                    partial[0] += values[i].value;
+                lua_pushnumber(L, (partial[0] + partial[1]) + (partial[2] + partial[3]));
+            }
+        });
+    }
+
+    // Pushes the smallest and the largest value. Returns false (and pushes nothing) for empty arrays
+    static bool min_max_array(lua_State* L, int idx) {
+        bool found = false;
+        with_numeric_array(L, idx, [L, &found](auto& values) {
+            if (values.empty())
+                return;
+            auto [min, max] = std::minmax_element(values.begin(), values.end(), [](const auto& lhs, const auto& rhs) { return number_less(lhs, rhs); });
+            push_number(L, *min);
+            push_number(L, *max);
+            found = true;
+        });
+        return found;
+    }
+
+    // Returns the index of the value at 'valueIdx' or 0 if it isn't found
+    static lua_Integer search_array(lua_State* L, int idx, int valueIdx) {
+        lua_Integer low = 1;
+        lua_Integer high = (lua_Integer)lua_rawlen(L, idx);
+        while (low <= high) {
+            lua_Integer middle = low + (high - low) / 2;
+            if (lua_rawgeti(L, idx, middle) != LUA_TNUMBER) {
+                lua_pop(L, 1);
+                throw Error("number", "Array contains a value that is not a number");
+            }
+            // Numbers are compared by Lua, so integers and floats are compared exactly
+            if (lua_compare(L, -1, valueIdx, LUA_OPEQ)) {
+                lua_pop(L, 1);
+                return middle;
+            }
+            bool less = lua_compare(L, -1, valueIdx, LUA_OPLT);
+            lua_pop(L, 1);
+            if (less)
+                low = middle + 1;
+            else
+                high = middle - 1;
+        }
+        return 0;
+    }
+
+    static lua_Unsigned unique_array(lua_State* L, int idx) {
+        lua_Unsigned length = lua_rawlen(L, idx);
+        lua_Unsigned newLength = 0;
+        with_numeric_array(L, idx, [L, idx, &newLength](auto& values) {
+            auto end = std::unique(values.begin(), values.end(), [](const auto& lhs, const auto& rhs) { return number_equal(lhs, rhs); });
+            values.erase(end, values.end());
+            write_numeric_array(L, idx, values);
+            newLength = values.size();
+        });
+        for (lua_Unsigned i = newLength + 1; i <= length; i++) {
+            lua_pushnil(L);
+            lua_rawseti(L, idx, (lua_Integer)i);
+        }
+        return newLength;
+    }
+
+    // Runs one of the array functions for Lua. Errors are raised after the buffers are freed
+    template<int(*Impl)(lua_State*)>
+    static int table_function(lua_State* L) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        int top = lua_gettop(L);
+        int results = 0;
+        bool failed = false;
+        try {
+            results = Impl(L);
+        } catch (const Error& e) {
+            lua_settop(L, top);
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        if (failed)
+            return lua_error(L);
+        return results;
+    }
+
+    static int table_sort_numeric(lua_State* L) {
+        sort_array(L, 1, lua_toboolean(L, 2));
+        return 0;
+    }
+
+    static int table_sum(lua_State* L) {
+        sum_array(L, 1);
+        return 1;
+    }
+
+    static int table_min_max(lua_State* L) {
+        return min_max_array(L, 1) ? 2 : 0;
+    }
+
+    static int table_binary_search(lua_State* L) {
+        if (lua_type(L, 2) != LUA_TNUMBER)
+            throw Error("number", "Searched value is not a number");
+        lua_Integer index = search_array(L, 1, 2);
+        if (index == 0)
+            return 0;
+        lua_pushinteger(L, index);
+        return 1;
+    }
+
+    static int table_unique(lua_State* L) {
+        lua_pushinteger(L, (lua_Integer)unique_array(L, 1));
+        return 1;
+    }
+}
+
+void lua_w::Table::sort_numeric(bool descending) const {
+    lua_State* L = tablePtr->L;
+    push_to_stack(L);
+    int top = lua_gettop(L);
+    try {
+        internal::sort_array(L, top, descending);
+    } catch (...) {
+        lua_settop(L, top - 1);
+        throw;
+    }
+    lua_pop(L, 1);
+}
+
+lua_Number lua_w::Table::sum() const {
+    lua_State* L = tablePtr->L;
+    push_to_stack(L);
+    int top = lua_gettop(L);
+    try {
+        internal::sum_array(L, top);
+    } catch (...) {
+        lua_settop(L, top - 1);
+        throw;
+    }
+    lua_Number sum = lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    return sum;
+}
+
+std::pair<lua_Number, lua_Number> lua_w::Table::min_max() const {
+    lua_State* L = tablePtr->L;
+    push_to_stack(L);
+    int top = lua_gettop(L);
+    bool found;
+    try {
+        found = internal::min_max_array(L, top);
+    } catch (...) {
+        lua_settop(L, top - 1);
+        throw;
+    }
+    if (!found) {
+        lua_pop(L, 1);
+        throw internal::Error("table", "Array is empty");
+    }
+    std::pair<lua_Number, lua_Number> result = { lua_tonumber(L, -2), lua_tonumber(L, -1) };
+    lua_pop(L, 3);
+    return result;
+}
+
+lua_Integer lua_w::Table::binary_search(lua_Number value) const {
+    lua_State* L = tablePtr->L;
+    push_to_stack(L);
+    lua_pushnumber(L, value);
+    int top = lua_gettop(L);
+    lua_Integer index;
+    try {
+        index = internal::search_array(L, top - 1, top);
+    } catch (...) {
+        lua_settop(L, top - 2);
+        throw;
+    }
+    lua_pop(L, 2);
+    return index;
+}
+
+lua_Unsigned lua_w::Table::unique() const {
+    lua_State* L = tablePtr->L;
+    push_to_stack(L);
+    int top = lua_gettop(L);
+    lua_Unsigned length;
+    try {
+        length = internal::unique_array(L, top);
+    } catch (...) {
+        lua_settop(L, top - 1);
+        throw;
+    }
+    lua_pop(L, 1);
+    return length;
+}
+
+void lua_w::register_table_functions(lua_State* L) noexcept {
+    static const luaL_Reg functions[] = {
+        { "sort_numeric", &internal::table_function<&internal::table_sort_numeric> },
+        { "sum", &internal::table_function<&internal::table_sum> },
+        { "min_max", &internal::table_function<&internal::table_min_max> },
+        { "binary_search", &internal::table_function<&internal::table_binary_search> },
+        { "unique", &internal::table_function<&internal::table_unique> },
+        { nullptr, nullptr }
+    };
+    if (lua_getglobal(L, "table") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, "table");
+    }
+    luaL_setfuncs(L, functions, 0);
+    lua_pop(L, 1);
+}
+lua_w::Type lua_w::type_of(lua_State* L, int idx) noexcept {
+    return (Type)lua_type(L, idx);
+}
+lua_w::EventBus::EventBus(lua_State* L) : busPtr(std::make_shared<internal::LuaObjectReference>(L)) {
+    lua_createtable(L, 2, 0);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 1);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, busPtr->get_object_id());
+}
+
+void lua_w::EventBus::rebuild() noexcept {
+    listeners.erase(std::remove_if(listeners.begin(), listeners.end(), [](const Listener& listener) { return listener.removed; }), listeners.end());
+    for (const Listener& listener : pending) {
+        if (listener.removed)
+            continue;
+        auto position = std::upper_bound(listeners.begin(), listeners.end(), listener.priority, [](int priority, const Listener& other) {
+            return priority > other.priority;
+        });
+        listeners.insert(position, listener);
+    }
+    pending.clear();
+
+    lua_State* L = busPtr->L;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, busPtr->get_object_id());
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_Unsigned oldLength = lua_rawlen(L, -2);
+    for (size_t i = 0; i < listeners.size(); i++) {
+        lua_rawgeti(L, -1, (lua_Integer)listeners[i].id);
+        lua_rawseti(L, -3, (lua_Integer)i + 1);
+    }
+    for (lua_Unsigned i = listeners.size() + 1; i <= oldLength; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, (lua_Integer)i);
+    }
+    lua_pop(L, 3);
+    dirty = false;
+}
+
+size_t lua_w::EventBus::add_listener(const Function& listener, int priority) noexcept {
+    lua_State* L = busPtr->L;
+    size_t id = nextId++;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, busPtr->get_object_id());
+    lua_rawgeti(L, -1, 2);
+    listener.push_to_stack(L);
+    lua_rawseti(L, -2, (lua_Integer)id);
+    lua_pop(L, 2);
+
+    pending.push_back({ id, priority, false });
+    dirty = true;
+    if (dispatching == 0)
+        rebuild();
+    return id;
+}
+
+bool lua_w::EventBus::remove_listener(size_t id) noexcept {
+    bool found = false;
+    for (auto* list : { &listeners, &pending }) {
+        for (Listener& listener : *list) {
+            if (listener.id == id && !listener.removed) {
+                listener.removed = true;
+                found = true;
+            }
+        }
+    }
+    if (!found)
+        return false;
+
+    lua_State* L = busPtr->L;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, busPtr->get_object_id());
+    lua_rawgeti(L, -1, 2);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, (lua_Integer)id);
+    lua_pop(L, 2);
+
+    dirty = true;
+    if (dispatching == 0)
+        rebuild();
+    return true;
+}
+
+size_t lua_w::EventBus::listener_count() const noexcept {
+    size_t count = 0;
+    for (const auto* list : { &listeners, &pending }) {
+        for (const Listener& listener : *list)
+            count += listener.removed ? 0 : 1;
+    }
+    return count;
+}
+namespace lua_w::internal {
+    struct BoundGlobal {
+        void* variable;
+        BoundGetter_t getter;
+        BoundSetter_t setter; // nullptr for read-only globals
+    };
+
+    // Bound globals by the address of their (interned) name
+    using BoundGlobals_t = std::unordered_map<const void*, BoundGlobal>;
+
+    static const BoundGlobal* find_bound_global(lua_State* L, int keyIdx) {
+        if (lua_type(L, keyIdx) != LUA_TSTRING)
+            return nullptr;
+        auto globals = (BoundGlobals_t*)lua_touserdata(L, lua_upvalueindex(1));
+        auto found = globals->find(lua_topointer(L, keyIdx));
+        return found != globals->end() ? &found->second : nullptr;
+    }
+
+    // '__index' of the globals table. Upvalue 1 is the userdata with the bound globals, upvalue 2 is the previous '__index'
+    static int bound_globals_index(lua_State* L) {
+        const BoundGlobal* bound = find_bound_global(L, 2);
+        if (!bound)
+            return chain_index(L, lua_upvalueindex(2));
+        bound->getter(L, bound->variable);
+        return 1;
+    }
+
+    // '__newindex' of the globals table. Upvalue 1 is the userdata with the bound globals, upvalue 2 is the previous '__newindex'
+    static int bound_globals_newindex(lua_State* L) {
+        const BoundGlobal* bound = find_bound_global(L, 2);
+        if (!bound) {
+            switch (lua_type(L, lua_upvalueindex(2))) {
+                case LUA_TFUNCTION:
+                    lua_pushvalue(L, lua_upvalueindex(2));
+                    lua_insert(L, 1);
+                    lua_call(L, 3, 0);
+                    break;
+                case LUA_TNIL:
+                    lua_rawset(L, 1);
+                    break;
+                default:
+                    lua_settable(L, lua_upvalueindex(2));
+            }
+            return 0;
+        }
+        if (!bound->setter)
+            return luaL_error(L, "attempt to modify a read-only global '%s'", lua_tostring(L, 2));
+        bool failed = false;
+        try {
+            bound->setter(L, 3, bound->variable);
+        } catch (const Error& e) {
+            lua_pushfstring(L, "wrong type assigned to the global '%s' (%s expected)", lua_tostring(L, 2), e.type());
+            failed = true;
+        }
+        if (failed)
+            return lua_error(L);
+        return 0;
+    }
+}
+
+void lua_w::internal::bind_global_impl(lua_State* L, const char* globalName, void* variable, BoundGetter_t getter, BoundSetter_t setter) {
+    if (std::strlen(globalName) > maxBoundNameLength)
+        throw Error("global", "Names of bound globals can't be longer than 40 characters");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "LUA_W_BOUND_GLOBALS") != LUA_TUSERDATA) {
+        lua_pop(L, 1);
+        // The user value keeps the names alive, so their addresses stay valid
+        new (lua_newuserdatauv(L, sizeof(BoundGlobals_t), 1)) BoundGlobals_t();
+        lua_newtable(L);
+        lua_setiuservalue(L, -2, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, [](lua_State* L) -> int {
+            ((BoundGlobals_t*)lua_touserdata(L, 1))->~unordered_map();
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, "LUA_W_BOUND_GLOBALS");
+
+        // Install the hooks, chaining to the previous ones
+        push_globals_metatable(L);
+        lua_pushvalue(L, -2);
+        lua_getfield(L, -2, "__index");
+        lua_pushcclosure(L, &bound_globals_index, 2);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -2);
+        lua_getfield(L, -2, "__newindex");
+        lua_pushcclosure(L, &bound_globals_newindex, 2);
+        lua_setfield(L, -2, "__newindex");
+        lua_pop(L, 1);
+    }
+
+    lua_pushstring(L, globalName);
+    const void* key = lua_topointer(L, -1);
+    lua_getiuservalue(L, -2, 1);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+
+    auto globals = (BoundGlobals_t*)lua_touserdata(L, -1);
+    (*globals)[key] = { variable, getter, setter };
+    lua_pop(L, 1);
+
+    // The hooks only run for globals that don't exist in the globals table
+    lua_pushglobaltable(L);
+    lua_pushstring(L, globalName);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
 #endif // End of LUA_W_IMPLEMENTATION
@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 
 #define LUA_W_IMPLEMENTATION
 #include "lua_w.h"
@@ -186,6 +187,18 @@ public:
     friend bool operator==(const Vec2& lhs, const Vec2& rhs) {
         return (lhs.x == rhs.x) && (lhs.y == rhs.y);
     }
+
+    void lua_serialise(const lua_w::Writer& writer) const {
+        writer((const char*)&x, sizeof(x));
+        writer((const char*)&y, sizeof(y));
+    }
+
+    static Vec2 lua_deserialise(const lua_w::Reader& reader) {
+        Vec2 vec;
+        reader((char*)&vec.x, sizeof(vec.x));
+        reader((char*)&vec.y, sizeof(vec.y));
+        return vec;
+    }
 };
 
 void should_handle_native_types() {
@@ -232,6 +245,1105 @@ void should_handle_native_types() {
     TEARDOWN
 }
 
+void should_load_modules_from_bundles() {
+    SETUP
+
+    lua_w::register_function(L, "bundle_c_func", +[]() -> int { return 42; });
+    ASSERT_SCRIPT(R"(
+        bytecode = string.dump(function() return { answer = bundle_c_func } end)
+    )");
+
+    static const std::string bundle = lua_w::make_bundle({
+        { "greeter", "local name = ...; return { greet = function(who) return 'Hello ' .. who .. ' from ' .. name end }" },
+        { "answer", lua_w::get_global<std::string>(L, "bytecode") }
+    });
+    lua_w::add_bundle_searcher(L, bundle.data(), bundle.size());
+
+    ASSERT_SCRIPT(R"(
+        local greeter = require "greeter"
+        assert(greeter.greet("Lua") == "Hello Lua from greeter")
+        assert(require("greeter") == greeter)
+        assert(require("answer").answer() == 42)
+
+        local ok, err = pcall(require, "missing")
+        assert(not ok and err:find("no module 'missing' in bundle", 1, true))
+    )");
+
+    // Not a bundle, a huge module count in a short header and duplicate module names
+    std::string duplicated = lua_w::make_bundle({ { "a", "return 1" }, { "b", "return 2" } });
+    duplicated[duplicated.find('b')] = 'a';
+    const std::string invalid[] = { "not a bundle", std::string("LUAWBNDL\xFF\xFF\xFF\xFF", 12), duplicated };
+    for (const auto& data : invalid) {
+        try {
+            lua_w::add_bundle_searcher(L, data.data(), data.size());
+            assert(false);
+        } catch (const lua_w::internal::Error& e) {
+            assert(std::strcmp(e.type(), "bundle") == 0);
+        }
+    }
+    assert(lua_gettop(L) == 0);
+
+    // package.searchers is missing
+    ASSERT_SCRIPT("package.searchers = nil");
+    try {
+        lua_w::add_bundle_searcher(L, bundle.data(), bundle.size());
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "bundle") == 0);
+    }
+    assert(lua_gettop(L) == 0);
+
+    try {
+        lua_w::make_bundle({ { "same", "" }, { "same", "" } });
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "bundle") == 0);
+    }
+
+    TEARDOWN
+}
+
+void should_open_libs_lazily() {
+    lua_State* L = luaL_newstate();
+    lua_w::init(L);
+    lua_w::open_libs_lazy(L, lua_w::Libs::base | lua_w::Libs::package | lua_w::Libs::math | lua_w::Libs::string);
+    {
+        lua_w::Baseline baseline(L);
+
+        ASSERT_SCRIPT(R"(
+            assert(rawget(_G, "math") == nil)
+            assert(math.floor(2.5) == 2)
+            assert(rawget(_G, "math") == math)
+            assert(package.loaded.math == math)
+
+            assert(rawget(_G, "string") == nil)
+            assert(("abc"):upper() == "ABC") -- Works before the 'string' global is accessed
+            local str = require "string"
+            assert(string == str)
+
+            assert(table == nil) -- Not requested
+            assert(os == nil)
+        )");
+
+        // Libraries removed by a reset are opened again
+        baseline.reset(L);
+        ASSERT_SCRIPT(R"(
+            assert(rawget(_G, "math") == nil)
+            assert(math.floor(2.5) == 2)
+        )");
+    }
+    lua_close(L);
+}
+
+void should_handle_deferred_types() {
+    SETUP
+
+    lua_w::register_type_deferred<Base>(L)
+        .add_method("get_name", &Base::get_name)
+        .add_constructor();
+
+    lua_w::register_type_deferred<Vec2>(L)
+        .add_parent_type<Base>()
+        .add_member("x", &Vec2::x)
+        .add_member("y", &Vec2::y)
+        .add_method("sqr_length", &Vec2::sqr_length)
+        .add_metamethod("__tostring", &Vec2::tostring)
+        .add_static_method("one", &Vec2::one)
+        .add_detected_operators()
+        .add_custom_and_default_constructors<double, double>();
+
+    ASSERT_SCRIPT(R"script(
+        assert(rawget(Vec2, "sqr_length") == nil)
+        local v = Vec2(3, 4)
+        assert(v:sqr_length() == 25)
+        assert(rawget(Vec2, "sqr_length") ~= nil)
+
+        assert(v:x() == 3)
+        v:y(0)
+        assert(v:y() == 0)
+        assert(tostring(Vec2.one()) == "(1, 1)")
+        assert(v + Vec2.one() == Vec2(4, 1))
+
+        assert(v:get_name() == "Vec2")
+        assert(rawget(Vec2, "get_name") == nil) -- Found in the parent type
+        assert(v.missing == nil)
+    )script");
+
+    // Adding the same binding again is allowed, but a different one can't replace it
+    lua_w::register_type_deferred<Vec2>(L).add_method("sqr_length", &Vec2::sqr_length);
+    lua_pushcfunction(L, [](lua_State* L) -> int {
+        lua_w::register_type_deferred<Vec2>(L).add_method("sqr_length", &Vec2::length);
+        return 0;
+    });
+    assert(lua_pcall(L, 0, 0, 0) == LUA_ERRRUN);
+    assert(std::strstr(lua_tostring(L, -1), "already registered differently") != nullptr);
+    lua_pop(L, 1);
+    ASSERT_SCRIPT("assert(Vec2(3, 4):sqr_length() == 25)");
+
+    // Bindings are recorded once and shared by all states
+    lua_State* other = luaL_newstate();
+    lua_w::open_libs(other, lua_w::Libs::base);
+    lua_w::register_type_deferred<Vec2>(other)
+        .add_custom_and_default_constructors<double, double>();
+    assert(luaL_dostring(other, "assert(Vec2(3, 4):x() == 3 and Vec2(3, 4):sqr_length() == 25)") == LUA_OK);
+    lua_w::register_type_deferred<Vec2>(other).add_method("length", &Vec2::length);
+    lua_close(other);
+    ASSERT_SCRIPT("assert(Vec2(3, 4):length() == 5)");
+
+    TEARDOWN
+}
+
+void should_handle_type_builders() {
+    SETUP
+
+    lua_w::TypeBuilder<Base> baseBuilder;
+    baseBuilder
+        .add_method("get_name", &Base::get_name)
+        .add_constructor();
+
+    lua_w::TypeBuilder<Vec2> vecBuilder;
+    vecBuilder
+        .add_parent_type<Base>()
+        .add_member("x", &Vec2::x)
+        .add_member("y", &Vec2::y)
+        .add_method("sqr_length", &Vec2::sqr_length)
+        .add_metamethod("__len", &Vec2::length)
+        .add_metamethod("__tostring", &Vec2::tostring)
+        .add_static_method("one", &Vec2::one)
+        .add_detected_operators()
+        .add_custom_and_default_constructors<double, double>();
+
+    baseBuilder.apply(L);
+    vecBuilder.apply(L);
+    vecBuilder.apply(L); // Already registered, nothing should happen
+    assert(lua_gettop(L) == 0);
+
+    ASSERT_SCRIPT(R"script(
+        local v = Vec2(3, 4)
+        assert(type(v) == "Vec2")
+        assert(v:x() == 3 and v:y() == 4)
+        assert(v:sqr_length() == 25)
+        assert(#v == 5)
+        assert(tostring(v) == "(3, 4)")
+        assert((v + Vec2.one()) == Vec2(4, 5))
+        assert(v:get_name() == "Vec2")
+        assert(Base():get_name() == "Base")
+    )script");
+
+    TEARDOWN
+}
+
+void should_replay_binding_sets() {
+    lua_w::BindingSet bindings;
+    bindings.register_type<Base>()
+        .add_method("get_name", &Base::get_name)
+        .add_constructor();
+    bindings.register_type<Vec2>()
+        .add_parent_type<Base>()
+        .add_member("x", &Vec2::x)
+        .add_method("sqr_length", &Vec2::sqr_length)
+        .add_detected_operators()
+        .add_custom_and_default_constructors<double, double>();
+    bindings.register_function("twice", +[](double a) -> double { return a * 2; });
+
+    for (int i = 0; i < 2; i++) {
+        SETUP
+
+        bindings.replay(L);
+        ASSERT_SCRIPT(R"script(
+            local v = Vec2(3, 4)
+            assert(v:sqr_length() == 25)
+            assert(v:x() == 3)
+            assert(v:get_name() == "Vec2")
+            assert(v + Vec2() == v)
+            assert(twice(21) == 42)
+        )script");
+
+        TEARDOWN
+    }
+}
+
+void should_reset_to_baseline() {
+    SETUP
+
+    lua_w::register_type<Vec2>(L)
+        .add_member("x", &Vec2::x)
+        .add_custom_and_default_constructors<double, double>();
+    ASSERT_SCRIPT("base_value = 1");
+
+    lua_w::Baseline baseline(L);
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT_SCRIPT(R"(
+            assert(base_value == 1)
+            assert(new_value == nil)
+
+            base_value = 2
+            new_value = Vec2(1, 2)
+            print = nil
+            string.custom = 1
+            package.loaded.fake = {}
+            Vec2.extra = 5
+            setmetatable(_G, { __index = function() return 7 end })
+        )");
+
+        baseline.reset(L);
+
+        ASSERT_SCRIPT(R"(
+            assert(getmetatable(_G) == nil)
+            assert(base_value == 1)
+            assert(new_value == nil)
+            assert(print ~= nil)
+            assert(string.custom == nil)
+            assert(package.loaded.fake == nil)
+            assert(Vec2.extra == nil)
+            assert(Vec2(3, 4):x() == 3)
+        )");
+    }
+
+    TEARDOWN
+}
+
+void should_snapshot_and_restore_state() {
+    std::string data;
+    SETUP
+
+    lua_w::register_type<Vec2>(L)
+        .add_member("x", &Vec2::x)
+        .add_custom_and_default_constructors<double, double>();
+
+    ASSERT_SCRIPT(R"(
+        local shared = { 1, 2, 3 }
+        index = { a = shared, b = shared, pos = Vec2(1, 2), pi = 3.5, n = 7, [10] = "ten" }
+        index.self = index
+        setmetatable(index, { __index = function(t, k) return k .. "!" end })
+
+        local counter = 10
+        function next_value() counter = counter + 1; return counter end
+        function peek() return counter end
+        index.fn = next_value
+    )");
+
+    lua_w::snapshot(L, [&data](const char* ptr, size_t size) { data.append(ptr, size); }, { "index", "next_value", "peek" });
+
+    try {
+        lua_w::snapshot(L, [](const char*, size_t) {}, { "print" });
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "snapshot") == 0);
+    }
+
+    // Too deep values throw instead of overflowing the C stack
+    ASSERT_SCRIPT("deep = {}; local t = deep; for i = 1, 150000 do t[1] = {}; t = t[1] end");
+    try {
+        lua_w::snapshot(L, [](const char*, size_t) {}, { "deep" });
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "snapshot") == 0);
+    }
+
+    TEARDOWN
+
+    L = luaL_newstate();
+    lua_w::init(L);
+    lua_w::open_libs(L, lua_w::Libs::all);
+    lua_w::register_type<Vec2>(L)
+        .add_member("x", &Vec2::x)
+        .add_custom_and_default_constructors<double, double>();
+
+    size_t readPos = 0;
+    lua_w::restore(L, [&data, &readPos](char* ptr, size_t size) {
+        if (data.size() - readPos < size)
+            throw lua_w::internal::Error("snapshot", "Not enough data");
+        std::memcpy(ptr, data.data() + readPos, size);
+        readPos += size;
+    });
+    assert(readPos == data.size());
+
+    // Corrupted snapshots: a huge string length and tables nested too deeply
+    std::string header = std::string("LUAWSNAP\1\0\0\0", 12) + std::string("\1\0\0\0\0\0\0\0x", 9);
+    std::string deepTable = std::string("\6", 1) + std::string(8, '\0') + std::string("\1\0\0\0\0\0\0\0", 8) + std::string("\0\3\1\0\0\0\0\0\0\0", 10);
+    std::string corrupted[] = { header + std::string("\5\xff\xff\xff\xff\xff\xff\xff\x7f", 9) + "abc", header };
+    for (int i = 0; i < 2000; i++)
+        corrupted[1] += deepTable;
+    for (const auto& bad : corrupted) {
+        bool deep = &bad == &corrupted[1];
+        size_t badPos = 0;
+        try {
+            lua_w::restore(L, [&bad, &badPos](char* ptr, size_t size) {
+                if (bad.size() - badPos < size)
+                    throw lua_w::internal::Error("snapshot", "Not enough data");
+                std::memcpy(ptr, bad.data() + badPos, size);
+                badPos += size;
+            });
+            assert(false);
+        } catch (const lua_w::internal::Error& e) {
+            assert(std::strcmp(e.type(), "snapshot") == 0);
+            assert(!deep || std::strstr(e.what(), "nested too deeply"));
+        }
+    }
+    assert(lua_gettop(L) == 0);
+
+    ASSERT_SCRIPT(R"(
+        assert(index.a == index.b and index.a[3] == 3)
+        assert(index.self == index)
+        assert(index.pos:x() == 1)
+        assert(math.type(index.n) == "integer" and index.pi == 3.5)
+        assert(index[10] == "ten")
+        assert(index.missing == "missing!")
+        assert(index.fn == next_value)
+        assert(next_value() == 11)
+        assert(peek() == 11)
+    )");
+
+    lua_close(L);
+}
+
+void should_handle_modules() {
+    SETUP
+
+    lua_w::Module engine;
+    engine.add_function("add", +[](double a, double b) -> double { return a + b; })
+        .add_value("version", 3);
+    engine.add_type<Vec2>()
+        .add_member("x", &Vec2::x)
+        .add_detected_operators()
+        .add_custom_and_default_constructors<double, double>();
+    engine.install(L, "engine");
+
+    ASSERT_SCRIPT(R"(
+        assert(Vec2 == nil)
+        assert(package.loaded.engine == nil)
+
+        local engine = require "engine"
+        assert(require("engine") == engine)
+        assert(engine.add(2, 3) == 5)
+        assert(engine.version == 3)
+        assert(engine.Vec2(1, 2):x() == 1)
+        assert(engine.Vec2(1, 2) + engine.Vec2() == engine.Vec2(1, 2))
+        assert(Vec2 == nil and add == nil)
+    )");
+
+    TEARDOWN
+}
+
+void should_handle_environments() {
+    SETUP
+
+    auto base = lua_w::Environment::create_base(L, lua_w::Libs::base | lua_w::Libs::math | lua_w::Libs::string);
+    base.set("shared", 5);
+    auto first = base.derive();
+    auto second = base.derive();
+
+    auto script = lua_w::load_script(L, "x = 1; y = math.floor(2.5); return x + y + shared", first);
+    assert(script.call<int>() == 8);
+    assert(first.get<int>("x") == 1);
+    assert(!lua_w::has_global<double>(L, "x"));
+
+    script = lua_w::load_script(L, R"(
+        assert(x == nil and os == nil and load == nil)
+        assert(not pcall(function() math.floor = nil end))
+        assert(math.floor(1.5) == 1)
+        assert(("abc"):upper() == "ABC")
+        assert(getmetatable(_ENV) == false)
+        return shared
+    )", second);
+    assert(script.call<int>() == 5);
+
+    // Scripts can't change what other scripts (or the host) see
+    auto tenant = lua_w::Environment::create_base(L, lua_w::Libs::base | lua_w::Libs::math | lua_w::Libs::string).derive();
+    script = lua_w::load_script(L, R"(
+        local function evil() return "pwned" end
+        assert(rawset == nil and getmetatable("") == nil and package == nil)
+        assert(not pcall(function() math.floor = evil end))
+        assert(not pcall(setmetatable, math, nil))
+        local count = 0
+        for name, value in pairs(math) do count = count + 1 end
+        assert(count > 10)
+    )", tenant);
+    script.call<void>();
+    ASSERT_SCRIPT(R"(
+        assert(math.floor(2.5) == 2 and ("x"):upper() == "X" and string.upper("x") == "X")
+    )");
+    assert(lua_w::load_script(L, "return math.floor(2.5) .. ('x'):upper()", second).call<std::string>() == "2X");
+
+    // package.loaded would give scripts everything (eg. 'package.loaded._G.load' or 'package.loaded.os')
+    try {
+        lua_w::Environment::create_base(L, lua_w::Libs::base | lua_w::Libs::package);
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "environment") == 0);
+    }
+
+    try {
+        lua_w::load_script(L, "this is not lua", first);
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "script") == 0);
+    }
+
+    TEARDOWN
+}
+
+void should_transfer_values() {
+    SETUP
+
+    lua_State* other = luaL_newstate();
+    lua_w::init(other);
+    lua_w::open_libs(other, lua_w::Libs::all);
+
+    for (lua_State* state : { L, other }) {
+        lua_w::register_type<Vec2>(state)
+            .add_member("x", &Vec2::x)
+            .add_custom_and_default_constructors<double, double>();
+    }
+
+    ASSERT_SCRIPT(R"(
+        local shared = { 1, 2, 3 }
+        data = { a = shared, b = shared, pos = Vec2(1, 2), pi = 3.5, n = 7, flag = true, [10] = "te\0n" }
+        data.self = data
+    )");
+
+    lua_getglobal(L, "data");
+    auto copy = lua_w::transfer(L, -1, other);
+    lua_pop(L, 1);
+    assert(lua_gettop(L) == 0 && lua_gettop(other) == 0);
+    lua_w::set_global(other, "copy", copy);
+
+    lua_close(L);
+    L = other; // ASSERT_SCRIPT runs in 'L'
+    ASSERT_SCRIPT(R"(
+        assert(copy.a == copy.b and #copy.a == 3 and copy.a[3] == 3)
+        assert(copy.self == copy)
+        assert(copy.pos:x() == 1)
+        assert(math.type(copy.n) == "integer" and copy.pi == 3.5 and copy.flag)
+        assert(copy[10] == "te\0n")
+    )");
+
+    lua_State* source = luaL_newstate();
+    luaL_dostring(source, "return { print = function() end }");
+    try {
+        lua_w::transfer(source, -1, L);
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "transfer") == 0);
+    }
+    assert(lua_gettop(source) == 1 && lua_gettop(L) == 0);
+
+    // Too deep tables throw instead of overflowing the C stack
+    luaL_dostring(source, "local deep = {}; local t = deep; for i = 1, 150000 do t[1] = {}; t = t[1] end; return deep");
+    try {
+        lua_w::transfer(source, -1, L);
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "transfer") == 0);
+    }
+    assert(lua_gettop(source) == 2 && lua_gettop(L) == 0);
+    lua_close(source);
+
+    TEARDOWN
+}
+
+void should_encode_and_decode_msgpack() {
+    SETUP
+
+    lua_w::register_type<Vec2>(L)
+        .add_member("x", &Vec2::x)
+        .add_custom_and_default_constructors<double, double>();
+    lua_w::register_msgpack_functions(L);
+
+    std::string data;
+    lua_w::Writer writer = [&data](const char* ptr, size_t size) { data.append(ptr, size); };
+    ASSERT_SCRIPT("return { 1, -2, 300 }");
+    lua_w::encode(L, -1, writer);
+    lua_pop(L, 1);
+    assert(data == std::string("\x93\x01\xfe\xcd\x01\x2c", 6));
+
+    ASSERT_SCRIPT(R"(
+        local value = {
+            n = 7, big = -5000000000, pi = 3.25, third = 1 / 3, s = ("x"):rep(300), flag = false,
+            list = { "a", { b = true }, 4.0 }, empty = {}, pos = Vec2(1, 2), [10] = "te\0n"
+        }
+        local copy = msgpack.decode(msgpack.encode(value))
+        assert(copy.n == 7 and math.type(copy.n) == "integer" and copy.big == -5000000000)
+        assert(copy.pi == 3.25 and copy.third == 1 / 3 and math.type(copy.list[3]) == "float")
+        assert(copy.s == value.s and copy.flag == false and copy[10] == "te\0n")
+        assert(#copy.list == 3 and copy.list[1] == "a" and copy.list[2].b)
+        assert(next(copy.empty) == nil and copy.pos:x() == 1)
+
+        local holes = { 1, 2, 3, 4 } -- '#' is still 4 and so is the entry count
+        holes[2] = nil
+        holes.x = 7
+        local copy = msgpack.decode(msgpack.encode(holes))
+        assert(copy.x == 7 and copy[1] == 1 and copy[2] == nil and copy[4] == 4)
+
+        assert(not pcall(msgpack.encode, { print }))
+        assert(not pcall(msgpack.decode, "\x93\x01"))
+        assert(not pcall(msgpack.decode, "\xdb\xff\xff\xff\xffabc")) -- Lengths longer than the data
+        assert(not pcall(msgpack.decode, "\xc9\xff\xff\xff\xff\x01abc"))
+        local cycle = {}
+        cycle.self = cycle
+        assert(not pcall(msgpack.encode, cycle))
+    )");
+
+    size_t readPos = 0;
+    lua_w::decode(L, [&data, &readPos](char* ptr, size_t size) {
+        if (data.size() - readPos < size)
+            throw lua_w::internal::Error("msgpack", "Not enough data");
+        std::memcpy(ptr, data.data() + readPos, size);
+        readPos += size;
+    });
+    auto table = lua_w::Table::get_form_stack(L, -1);
+    lua_pop(L, 1);
+    assert(readPos == data.size() && table.get<int>(3) == 300);
+
+    TEARDOWN
+}
+
+void should_handle_json() {
+    SETUP
+
+    lua_w::register_json_functions(L);
+
+    auto table = lua_w::from_json(L, R"( { "name": "lua_w", "tags": ["a", "b\né😀"], "count": 3, "ratio": 0.5, "big": 1e3, "none": null, "ok": true } )");
+    assert(std::strcmp(table.get<const char*>("name"), "lua_w") == 0);
+    assert(table.get<int>("count") == 3 && table.get<double>("ratio") == 0.5);
+    assert(table.get<lua_w::Table>("tags").get<std::string>(2) == "b\n\xc3\xa9\xf0\x9f\x98\x80");
+    lua_w::set_global(L, "parsed", table);
+
+    try {
+        lua_w::from_json(L, R"({ "a": [1, 2 })");
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "json") == 0);
+    }
+    assert(lua_gettop(L) == 0);
+
+    lua_w::JsonEncoder encoder;
+    ASSERT_SCRIPT(R"(return { 1, 2.5, "q\"", { x = false }, {} })");
+    assert(encoder.encode(L, -1) == R"([1,2.5,"q\"",{"x":false},[]])");
+    lua_pop(L, 1);
+    ASSERT_SCRIPT("return { 0.1, 1 / 3, 2.0 }"); // The shortest form that reads back as the same number
+    assert(encoder.encode(L, -1) == "[0.1,0.3333333333333333,2.0]");
+    lua_pop(L, 1);
+
+    ASSERT_SCRIPT(R"(
+        assert(math.type(parsed.count) == "integer" and math.type(parsed.big) == "float")
+        assert(parsed.none == nil and parsed.ok == true)
+
+        local value = { list = { 1, 2.0, 0.1, -3 }, nested = { [5] = "five", key = "\1" }, s = "tab\t" }
+        local copy = json.decode(json.encode(value))
+        assert(math.type(copy.list[1]) == "integer" and math.type(copy.list[2]) == "float")
+        assert(copy.list[3] == 0.1 and copy.list[4] == -3)
+        assert(copy.nested["5"] == "five" and copy.nested.key == "\1" and copy.s == "tab\t")
+
+        local items = json.decode('[{"id": 1}, {"id": 2}, {"id": 3}]')
+        assert(#items == 3 and items[3].id == 3)
+
+        assert(not pcall(json.decode, "[1, 2,]"))
+        assert(not pcall(json.decode, "{} x"))
+        local holes = { 1, 2, 3, 4 } -- Encoded as an object, as it isn't a sequence
+        holes[2] = nil
+        holes.x = 7
+        local copy = json.decode(json.encode(holes))
+        assert(copy.x == 7 and copy["1"] == 1 and copy["2"] == nil and copy["4"] == 4)
+
+        assert(not pcall(json.encode, { print }))
+        assert(not pcall(json.encode, 0/0))
+    )");
+
+    TEARDOWN
+}
+
+void should_track_changes_in_observed_tables() {
+    SETUP
+
+    lua_w::ObservedTable settings(L);
+    settings.set("volume", 5);
+    settings.set("name", "default");
+    assert(!settings.has_changes());
+    lua_w::set_global(L, "settings", settings);
+
+    ASSERT_SCRIPT(R"(
+        assert(settings.volume == 5 and settings.name == "default")
+        settings.volume = 7
+        settings.name = "default" -- Same value, not a change
+        settings[1] = "first"
+        settings.fresh = true
+        assert(#settings == 1 and rawget(settings, "volume") == nil)
+        local count = 0
+        for k, v in pairs(settings) do count = count + 1 end
+        assert(count == 4)
+    )");
+
+    assert(settings.has_changes());
+    auto changes = settings.drain_changes();
+    assert(changes.size() == 3 && !settings.has_changes());
+    std::sort(changes.begin(), changes.end());
+    assert(changes[0] == "1" && changes[1] == "fresh" && changes[2] == "volume");
+    assert(settings.get<int>("volume") == 7 && settings.storage().get<bool>("fresh"));
+
+    ASSERT_SCRIPT("settings.volume = nil");
+    assert(settings.drain_changes() == std::vector<std::string>{ "volume" });
+
+    // Detaching the metatable can't free the change set or the storage
+    ASSERT_SCRIPT(R"(
+        settings.name = "changed"
+        assert(getmetatable(settings) == false)
+        assert(not pcall(setmetatable, settings, nil))
+        debug.setmetatable(settings, nil)
+        collectgarbage()
+        collectgarbage()
+    )");
+    assert(settings.has_changes() && settings.drain_changes() == std::vector<std::string>{ "name" });
+    settings.set("volume", 3);
+    assert(settings.get<int>("volume") == 3 && settings.storage().get<std::string>("name") == "changed");
+
+    TEARDOWN
+}
+
+void should_iterate_with_table_cursors() {
+    SETUP
+
+    ASSERT_SCRIPT(R"(
+        big = {}
+        for i = 1, 1000 do big[i] = i end
+        big[0.5] = 7
+    )");
+
+    auto big = lua_w::get_global<lua_w::Table>(L, "big");
+    lua_w::TableCursor cursor(L, big);
+    double sum = 0;
+    size_t slices = 0;
+    auto add = [&sum](double, double value) { sum += value; };
+    while (!cursor.advance<double, double>(300, add))
+        slices++;
+    assert(slices == 3 && sum == 500500 + 7 && cursor.finished());
+    assert(lua_gettop(L) == 0);
+
+    cursor.reset();
+    sum = 0;
+    while (!cursor.advance_until<double, double>(std::chrono::steady_clock::now() + std::chrono::milliseconds(1), add)) {}
+    assert(sum == 500500 + 7);
+
+    cursor.reset();
+    try {
+        cursor.advance<double, bool>(2000, [](double, bool) {});
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "bool") == 0);
+    }
+    assert(lua_gettop(L) == 0 && !cursor.finished());
+
+    TEARDOWN
+}
+
+void should_handle_numeric_arrays() {
+    SETUP
+
+    lua_w::register_table_functions(L);
+
+    ASSERT_SCRIPT("numbers = { 5, 3, 9, 3, 1, 9 }");
+    auto numbers = lua_w::get_global<lua_w::Table>(L, "numbers");
+    assert(numbers.sum() == 30);
+    assert(numbers.min_max() == std::make_pair(1.0, 9.0));
+    numbers.sort_numeric();
+    assert(numbers.get<int>(1) == 1 && numbers.get<int>(6) == 9);
+    assert(numbers.unique() == 4 && numbers.length() == 4);
+    assert(numbers.binary_search(5) == 3 && numbers.binary_search(4) == 0);
+    assert(lua_gettop(L) == 0);
+
+    ASSERT_SCRIPT(R"(
+        assert(numbers[1] == 1 and numbers[4] == 9 and math.type(numbers[4]) == "integer")
+
+        local mixed = { 2.5, 1, 0/0, 7, -1.5 }
+        table.sort_numeric(mixed, true)
+        assert(mixed[1] == 7 and math.type(mixed[1]) == "integer" and mixed[4] == -1.5 and mixed[5] ~= mixed[5])
+        assert(math.type(table.sum({ 1, 2, 3 })) == "integer" and table.sum({ 1, 2.5 }) == 3.5)
+
+        -- 2^53 + 1 can't be converted to a float, but it's still larger than 2^53
+        local large = { 9007199254740993, 2.0^53, 0.5 }
+        table.sort_numeric(large)
+        assert(large[1] == 0.5 and large[2] == 2.0^53 and large[3] == 9007199254740993)
+        local min, max = table.min_max({ 2.0^53, 9007199254740993, 2.0^63, math.mininteger, -2.0^63 })
+        assert(min == math.mininteger and max == 2.0^63)
+
+        local min, max = table.min_max({ 4, -2.5, 8 })
+        assert(min == -2.5 and max == 8)
+        assert(select("#", table.min_max({})) == 0)
+        assert(table.binary_search({ 1, 3, 5, 7 }, 7) == 4 and table.binary_search({ 1, 3 }, 2) == nil)
+        assert(not pcall(table.sum, { 1, "2" }))
+        assert(table.insert ~= nil)
+    )");
+
+    TEARDOWN
+}
+
+void should_handle_standard_containers() {
+    SETUP
+
+    lua_w::register_function(L, "total", +[](std::vector<int> values) -> int {
+        int total = 0;
+        for (int value : values)
+            total += value;
+        return total;
+    });
+    lua_w::register_function(L, "lengths", +[](std::map<std::string, std::vector<double>> values) -> std::map<std::string, int> {
+        std::map<std::string, int> lengths;
+        for (const auto& [key, list] : values)
+            lengths[key] = (int)list.size();
+        return lengths;
+    });
+    lua_w::set_global(L, "tags", std::set<std::string>{ "a", "b" });
+    lua_w::set_global(L, "point", std::array<double, 3>{ 1, 2, 3 });
+
+    ASSERT_SCRIPT(R"(
+        assert(total({ 1, 2, 3 }) == 6)
+        local lengths = lengths({ x = { 1, 2 }, y = {} })
+        assert(lengths.x == 2 and lengths.y == 0)
+        assert(tags.a and tags.b and #point == 3 and point[3] == 3)
+        assert(not pcall(total, { 1, "x" }))
+        assert(not pcall(total, 5))
+
+        ids = { [1] = "one", [20] = "twenty" }
+        flags = { on = true, off = false }
+    )");
+
+    auto ids = lua_w::get_global<std::unordered_map<int, std::string>>(L, "ids");
+    assert(ids.size() == 2 && ids[20] == "twenty");
+    auto names = lua_w::get_global<std::map<std::string, std::string>>(L, "ids");
+    assert(names["1"] == "one");
+    assert(lua_w::get_global<std::set<std::string>>(L, "flags") == std::set<std::string>{ "on" });
+    assert((lua_w::get_global<std::array<double, 3>>(L, "point") == std::array<double, 3>{ 1, 2, 3 }));
+    try {
+        lua_w::get_global<std::array<double, 2>>(L, "point");
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "table") == 0);
+    }
+
+    TEARDOWN
+}
+
+void should_handle_optionals_and_variants() {
+    SETUP
+
+    lua_w::register_function(L, "greet", +[](std::string name, std::optional<std::string> greeting) -> std::string {
+        return greeting.value_or("Hello") + ", " + name;
+    });
+    lua_w::register_function(L, "describe", +[](std::variant<int, double, std::string, lua_w::Table> value) -> std::string {
+        switch (value.index()) {
+            case 0: return "int";
+            case 1: return "double";
+            case 2: return "string";
+            default: return "table";
+        }
+    });
+    lua_w::register_function(L, "find", +[](int id) -> std::optional<std::variant<int, std::string>> {
+        if (id == 1)
+            return 10;
+        if (id == 2)
+            return std::string("two");
+        return std::nullopt;
+    });
+
+    ASSERT_SCRIPT(R"(
+        assert(greet("Lua") == "Hello, Lua" and greet("Lua", "Hi") == "Hi, Lua" and greet("Lua", nil) == "Hello, Lua")
+        assert(describe(1) == "int" and describe(1.5) == "double" and describe("1") == "string" and describe({}) == "table")
+        assert(not pcall(describe, true))
+        assert(find(1) == 10 and find(2) == "two" and find(3) == nil)
+    )");
+
+    lua_pushliteral(L, "12");
+    auto lenient = lua_w::internal::stack_get<std::variant<bool, int>>(L, -1);
+    assert(std::get<int>(lenient) == 12);
+    lua_pop(L, 1);
+
+    TEARDOWN
+}
+
+void should_probe_values_without_exceptions() {
+    SETUP
+
+    ASSERT_SCRIPT(R"(
+        count = 3
+        name = "lua_w"
+        config = { depth = 2, list = { 1, 2 }, bad = { 1, "x" } }
+    )");
+
+    assert(lua_w::try_get_global<int>(L, "count") == 3);
+    assert(!lua_w::try_get_global<int>(L, "missing"));
+    assert(!lua_w::try_get_global<lua_w::Table>(L, "name"));
+    assert(lua_w::has_global<lua_w::Table>(L, "config") && !lua_w::has_global<bool>(L, "config"));
+
+    auto config = lua_w::get_global<lua_w::Table>(L, "config");
+    assert(config.try_get<int>("depth") == 2);
+    assert(!config.try_get<std::string>("missing"));
+    assert(config.try_get<std::vector<int>>("list")->size() == 2);
+    assert(!config.try_get<std::vector<int>>("bad"));
+    assert(lua_gettop(L) == 0);
+
+    lua_pushinteger(L, 5);
+    assert(lua_w::internal::stack_try_get<double>(L, -1) == 5.0);
+    assert(!lua_w::internal::stack_try_get<lua_w::Function>(L, -1));
+    assert(lua_w::type_of(L, -1) == lua_w::Type::number && lua_w::type_of(L, 5) == lua_w::Type::none);
+    lua_pop(L, 1);
+
+    TEARDOWN
+}
+
+void should_handle_typed_functions() {
+    SETUP
+
+    ASSERT_SCRIPT(R"(
+        function scale(x, factor) return x * factor end
+        function fail() error("failed on purpose") end
+        handlers = { on_event = function(name) last_event = name end }
+    )");
+
+    auto scale = lua_w::get_global<lua_w::TypedFunction<double(double, double)>>(L, "scale");
+    assert(scale(2, 4) == 8);
+    std::function<double(double, double)> callback = scale;
+    assert(callback(3, 3) == 9);
+
+    auto handlers = lua_w::get_global<lua_w::Table>(L, "handlers");
+    std::function<void(std::string)> onEvent = handlers.get<lua_w::TypedFunction<void(std::string)>>("on_event");
+    onEvent("clicked");
+    assert(lua_w::get_global<std::string>(L, "last_event") == "clicked");
+
+    auto fail = lua_w::get_global<lua_w::TypedFunction<void()>>(L, "fail");
+    try {
+        fail();
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "function") == 0 && std::strstr(e.what(), "failed on purpose"));
+    }
+    assert(lua_gettop(L) == 0);
+
+    lua_w::register_function(L, "apply", +[](lua_w::TypedFunction<double(double)> function, double value) -> double {
+        return function(value);
+    });
+    ASSERT_SCRIPT("assert(apply(function(x) return x + 1 end, 1) == 2)");
+
+    TEARDOWN
+}
+
+void should_call_methods_on_objects() {
+    SETUP
+
+    lua_w::register_type<Vec2>(L)
+        .add_method("length", &Vec2::length)
+        .add_member("x", &Vec2::x)
+        .add_custom_and_default_constructors<double, double>();
+
+    ASSERT_SCRIPT(R"(
+        counter = { value = 0 }
+        function counter:add(amount) self.value = self.value + amount; return self.value end
+        position = Vec2(3, 4)
+    )");
+
+    lua_w::Key add(L, "add");
+    auto counter = lua_w::get_global<lua_w::Table>(L, "counter");
+    assert(counter.call_method<int>(add, 2) == 2);
+    assert(counter.call_method<int>("add", 3) == 5);
+    assert(counter.get<int>(lua_w::Key(L, "value")) == 5);
+
+    auto position = lua_w::get_global<lua_w::Object>(L, "position");
+    assert(position.call_method<double>("length") == 5);
+    assert(position.call_method<double>(lua_w::Key(L, "x")) == 3);
+
+    auto object = lua_w::get_global<lua_w::Object>(L, "counter");
+    object.call_method<void>(add, 1);
+    assert(object.get<int>("value") == 6);
+
+    try {
+        object.call_method<void>("missing");
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "function") == 0);
+    }
+    assert(!lua_w::has_global<lua_w::Object>(L, "print"));
+    assert(lua_gettop(L) == 0);
+
+    TEARDOWN
+}
+
+struct Counter {
+    int value = 0;
+    void add(int amount) { value += amount; }
+    int get() const { return value; }
+};
+
+void should_bind_methods_to_objects() {
+    SETUP
+
+    Counter counter;
+    lua_w::bind(L, &counter, &Counter::add);
+    lua_setglobal(L, "add");
+    lua_w::bind<&Counter::get>(L, &counter);
+    lua_setglobal(L, "get");
+
+    ASSERT_SCRIPT(R"(
+        add(2)
+        add(3)
+        assert(get() == 5)
+        assert(not pcall(add, "x"))
+    )");
+    assert(counter.value == 5);
+
+    TEARDOWN
+}
+
+void should_memoize_functions() {
+    SETUP
+
+    ASSERT_SCRIPT(R"(
+        calls = 0
+        function price(item, amount) calls = calls + 1; return #item * amount end
+        function length(str) return #str end
+    )");
+
+    lua_w::Memoized<double(std::string, int)> price(lua_w::get_global<lua_w::TypedFunction<double(std::string, int)>>(L, "price"), 2);
+    assert(price("apple", 2) == 10);
+    assert(price("apple", 2) == 10);
+    assert(price("pear", 1) == 4);
+    assert(price("apple", 2) == 10);
+    assert(price("apple", 3) == 15); // Drops ("pear", 1)
+    assert(price("apple", 2) == 10);
+    assert(price("pear", 1) == 4);
+    assert(price.hits() == 3 && price.misses() == 4 && price.size() == 2);
+    assert(lua_w::get_global<int>(L, "calls") == 4);
+
+    // C strings are compared by their contents, so a reused buffer doesn't return a stale result
+    lua_w::Memoized<int(const char*)> length(lua_w::get_global<lua_w::TypedFunction<int(const char*)>>(L, "length"), 4);
+    char buffer[8] = "apple";
+    assert(length(buffer) == 5);
+    std::strcpy(buffer, "fig");
+    assert(length(buffer) == 3 && length.misses() == 2);
+
+    ASSERT_SCRIPT("function price(item, amount) return 0 end");
+    price.invalidate(lua_w::get_global<lua_w::TypedFunction<double(std::string, int)>>(L, "price"));
+    assert(price.size() == 0 && price("apple", 2) == 0);
+
+    TEARDOWN
+}
+
+void should_dispatch_events() {
+    SETUP
+
+    lua_w::EventBus bus(L);
+    lua_w::bind(L, &bus, &lua_w::EventBus::remove_listener);
+    lua_setglobal(L, "remove_listener");
+
+    ASSERT_SCRIPT(R"(
+        log = {}
+        function low(name) log[#log + 1] = "low " .. name end
+        function high(name) log[#log + 1] = "high " .. name end
+        function fail(name) error("listener failed") end
+        function remover(name) remove_listener(low_id) end
+    )");
+
+    auto lowId = bus.add_listener(lua_w::get_global<lua_w::Function>(L, "low"));
+    bus.add_listener(lua_w::get_global<lua_w::Function>(L, "high"), 10);
+    bus.add_listener(lua_w::get_global<lua_w::Function>(L, "fail"), 5);
+    assert(bus.listener_count() == 3);
+
+    std::vector<std::string> errors;
+    bus.set_error_handler([&](const char* message) {
+        errors.push_back(message);
+        if (errors.size() == 1) // Added during the dispatch, so it is called form the next one
+            bus.add_listener(lua_w::get_global<lua_w::Function>(L, "remover"), 7);
+    });
+
+    assert(bus.dispatch("first") == 1);
+    assert(errors.size() == 1 && errors[0].find("listener failed") != std::string::npos);
+    assert(bus.listener_count() == 4);
+
+    lua_w::set_global(L, "low_id", (double)lowId);
+    assert(bus.dispatch(std::string("second")) == 1);
+    assert(bus.listener_count() == 3 && lua_gettop(L) == 0);
+
+    ASSERT_SCRIPT(R"(
+        assert(#log == 3)
+        assert(log[1] == "high first" and log[2] == "low first" and log[3] == "high second")
+    )");
+
+    TEARDOWN
+}
+
+void should_bind_globals() {
+    lua_State* L = luaL_newstate();
+    lua_w::open_libs_lazy(L, lua_w::Libs::base | lua_w::Libs::math);
+
+    double frameTime = 0.016;
+    int playerCount = 3;
+    const std::string mapName = "arena";
+    lua_w::set_global(L, "player_count", 1.0); // Replaced by the binding
+    lua_w::bind_global(L, "frame_time", &frameTime);
+    lua_w::bind_global(L, "player_count", &playerCount);
+    lua_w::bind_global(L, "map_name", &mapName);
+
+    ASSERT_SCRIPT(R"(
+        assert(frame_time == 0.016 and player_count == 3 and map_name == "arena")
+        assert(rawget(_G, "player_count") == nil)
+        player_count = player_count + 1
+        other = 5 -- Not bound globals still work
+        assert(rawget(_G, "other") == 5)
+        assert(math.floor(2.5) == 2) -- Lazy libraries are still opened
+    )");
+    assert(playerCount == 4);
+
+    frameTime = 0.033;
+    ASSERT_SCRIPT("assert(frame_time == 0.033)");
+    assert(luaL_dostring(L, "map_name = 'other'") != LUA_OK);
+    lua_pop(L, 1);
+    assert(luaL_dostring(L, "player_count = 'many'") != LUA_OK);
+    lua_pop(L, 1);
+    assert(playerCount == 4 && mapName == "arena" && lua_gettop(L) == 0);
+
+    // Long names are never interned, so they can't be bound
+    const char* longName = "a_global_with_a_name_that_is_too_long_to_bind";
+    lua_w::set_global(L, longName, 1.0);
+    try {
+        lua_w::bind_global(L, longName, &frameTime);
+        assert(false);
+    } catch (const lua_w::internal::Error& e) {
+        assert(std::strcmp(e.type(), "global") == 0);
+    }
+    assert(lua_w::get_global<double>(L, longName) == 1);
+
+    lua_close(L);
+}
+
+void should_handle_global_refs() {
+    SETUP
+
+    lua_w::GlobalRef<double> counter(L, "counter");
+    lua_w::GlobalRef<lua_w::Table> config(L, "config");
+    assert(!counter.try_get().has_value());
+
+    counter.set(1);
+    ASSERT_SCRIPT(R"(
+        assert(counter == 1)
+        counter = counter + 1
+        config = { speed = 10 }
+    )");
+    assert(counter.get() == 2);
+    assert(config.get().get<double>("speed") == 10);
+
+    ASSERT_SCRIPT("counter = 'text'");
+    assert(!counter.try_get().has_value());
+    bool thrown = false;
+    try {
+        counter.get();
+    } catch (const lua_w::internal::Error&) {
+        thrown = true;
+    }
+    assert(thrown && lua_gettop(L) == 0);
+
+    TEARDOWN
+}
+
 int main() {
     RUN_TEST(should_handle_globals);
     RUN_TEST(should_handle_functions);
@@ -239,5 +1351,30 @@ int main() {
     RUN_TEST(should_throw_errors);
     RUN_TEST(should_handle_tables);
     RUN_TEST(should_handle_native_types);
+    RUN_TEST(should_handle_deferred_types);
+    RUN_TEST(should_handle_type_builders);
+    RUN_TEST(should_replay_binding_sets);
+    RUN_TEST(should_handle_modules);
+    RUN_TEST(should_handle_environments);
+    RUN_TEST(should_load_modules_from_bundles);
+    RUN_TEST(should_open_libs_lazily);
+    RUN_TEST(should_reset_to_baseline);
+    RUN_TEST(should_snapshot_and_restore_state);
+    RUN_TEST(should_transfer_values);
+    RUN_TEST(should_encode_and_decode_msgpack);
+    RUN_TEST(should_handle_json);
+    RUN_TEST(should_track_changes_in_observed_tables);
+    RUN_TEST(should_iterate_with_table_cursors);
+    RUN_TEST(should_handle_numeric_arrays);
+    RUN_TEST(should_handle_standard_containers);
+    RUN_TEST(should_handle_optionals_and_variants);
+    RUN_TEST(should_probe_values_without_exceptions);
+    RUN_TEST(should_handle_typed_functions);
+    RUN_TEST(should_call_methods_on_objects);
+    RUN_TEST(should_bind_methods_to_objects);
+    RUN_TEST(should_memoize_functions);
+    RUN_TEST(should_dispatch_events);
+    RUN_TEST(should_bind_globals);
+    RUN_TEST(should_handle_global_refs);
     std::cout << "Tests passed!\n";
 }